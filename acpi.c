@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ACPI tables.
+ *
+ * Finds the Root System Description Pointer (RSDP) in the BIOS areas, then
+ * reads the NUMA topology from two of the tables that it leads to. The
+ * System Resource Affinity Table (SRAT) gives the proximity domain of each
+ * memory range and CPU, and the System Locality Information Table (SLIT)
+ * gives the relative distance between each pair of domains. Domains are
+ * numbered as nodes in the order that they are first seen.
+ *
+ * The tables are only read at boot, through the mapping made in the
+ * loader.asm file, so what is needed is kept here. Without an SRAT, all
+ * memory belongs to node zero.
+ */
+
+#include "acpi.h"
+#include "address.h"
+#include "asm_lib.h"
+#include "defs.h"
+#include "k_printf.h"
+
+/* Where the RSDP can be. It is on a 16 byte boundary. */
+#define EBDA_SEGMENT_PA       0x40E
+#define EBDA_SEARCH_SIZE      1024
+#define BIOS_AREA_PA          0xE0000
+#define BIOS_AREA_END_PA_EXCL 0x100000
+#define RSDP_ALIGNMENT        16
+#define RSDP_V1_SIZE          20
+
+/* SRAT structure types. */
+#define SRAT_CPU_AFFINITY    0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+
+#define SRAT_ENABLED 1
+
+/* Bytes after the header before the first SRAT structure. */
+#define SRAT_RESERVED_SIZE 12
+
+/* SLIT distances when there is no SLIT. */
+#define LOCAL_DISTANCE  10
+#define REMOTE_DISTANCE 20
+
+#define MAX_NUMA_RANGES 64
+
+struct rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_pa;
+    /* From revision 2. */
+    uint32_t length;
+    uint64_t xsdt_pa;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct sdt_header {
+    char signature[4];
+    uint32_t length; /* Including the header. */
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct srat_cpu_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved_1;
+    uint64_t base_pa;
+    uint64_t size;
+    uint32_t reserved_2;
+    uint32_t flags;
+    uint64_t reserved_3;
+} __attribute__((packed));
+
+struct srat_x2apic_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved_1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved_2;
+} __attribute__((packed));
+
+struct numa_range {
+    uint64_t start_pa;
+    uint64_t end_pa_excl;
+    uint32_t node;
+};
+
+static struct numa_range numa_range[MAX_NUMA_RANGES];
+static uint32_t num_numa_ranges = 0;
+
+/* Proximity domain of each node. */
+static uint32_t node_domain[MAX_NUMA_NODES];
+static uint32_t num_numa_nodes = 1;
+
+static uint8_t distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+/* Node of the boot CPU. */
+static uint32_t boot_node = 0;
+
+static int checksum_ok(const void *p, uint64_t size)
+{
+    const uint8_t *q = (const uint8_t *) p;
+    uint8_t sum = 0;
+
+    while (size--) sum = (uint8_t) (sum + *q++);
+
+    return sum == 0;
+}
+
+static int is_mapped(uint64_t pa, uint64_t size)
+{
+    /* Checks that a physical range is covered by the loader.asm mapping. */
+    uint64_t max_pa_excl = va_to_pa(MAX_MAPPED_VA_EXCL);
+
+    return pa < max_pa_excl && size <= max_pa_excl - pa;
+}
+
+static struct rsdp *scan_for_rsdp(uint64_t start_pa, uint64_t end_pa_excl)
+{
+    uint64_t p;
+
+    for (p = start_pa; p + RSDP_V1_SIZE <= end_pa_excl; p += RSDP_ALIGNMENT)
+        if (!memcmp((const void *) pa_to_va(p), "RSD PTR ", 8)
+            && checksum_ok((const void *) pa_to_va(p), RSDP_V1_SIZE))
+            return (struct rsdp *) pa_to_va(p);
+
+    return 0;
+}
+
+static struct rsdp *find_rsdp(void)
+{
+    /* Searches the first KiB of the EBDA, then the BIOS read-only area. */
+    uint64_t ebda_pa;
+    struct rsdp *r;
+
+    ebda_pa = (uint64_t) *(uint16_t *) pa_to_va(EBDA_SEGMENT_PA) << 4;
+
+    if (ebda_pa && ebda_pa < BIOS_AREA_PA
+        && (r = scan_for_rsdp(ebda_pa, ebda_pa + EBDA_SEARCH_SIZE)))
+        return r;
+
+    return scan_for_rsdp(BIOS_AREA_PA, BIOS_AREA_END_PA_EXCL);
+}
+
+static struct sdt_header *get_table(uint64_t pa)
+{
+    /* Returns the table at a physical address, if it is valid. */
+    struct sdt_header *h;
+
+    if (!is_mapped(pa, sizeof(struct sdt_header)))
+        return 0;
+
+    h = (struct sdt_header *) pa_to_va(pa);
+
+    if (h->length < sizeof(struct sdt_header) || !is_mapped(pa, h->length)
+        || !checksum_ok(h, h->length))
+        return 0;
+
+    return h;
+}
+
+static struct sdt_header *find_table(struct rsdp *r, const char *signature)
+{
+    /* Looks through the XSDT, or the RSDT before ACPI 2.0, for a table. */
+    struct sdt_header *sdt, *h;
+    uint64_t entry_pa;
+    uint32_t entry_size, i, n;
+    unsigned char *entries;
+
+    if (r->revision >= 2 && r->xsdt_pa) {
+        sdt = get_table(r->xsdt_pa);
+        entry_size = sizeof(uint64_t);
+    } else {
+        sdt = get_table(r->rsdt_pa);
+        entry_size = sizeof(uint32_t);
+    }
+
+    if (sdt == 0)
+        return 0;
+
+    entries = (unsigned char *) (sdt + 1);
+    n = (sdt->length - (uint32_t) sizeof(struct sdt_header)) / entry_size;
+
+    for (i = 0; i < n; ++i) {
+        /* The entries are not necessarily aligned. */
+        entry_pa = 0;
+        memcpy(&entry_pa, entries + i * entry_size, entry_size);
+
+        if ((h = get_table(entry_pa)) && !memcmp(h->signature, signature, 4))
+            return h;
+    }
+
+    return 0;
+}
+
+static int domain_to_node(uint32_t domain, uint32_t *node)
+{
+    /* Gets the node of a proximity domain, giving it one if it is new. */
+    uint32_t i;
+
+    for (i = 0; i < num_numa_nodes; ++i)
+        if (node_domain[i] == domain) {
+            *node = i;
+            return 0;
+        }
+
+    if (num_numa_nodes == MAX_NUMA_NODES) {
+        (void) k_printf("ERROR: ACPI: Too many NUMA nodes\n");
+        return -1;
+    }
+
+    node_domain[num_numa_nodes] = domain;
+    *node = num_numa_nodes++;
+
+    return 0;
+}
+
+static int parse_srat(struct sdt_header *h, uint32_t boot_apic_id)
+{
+    unsigned char *p, *end;
+    struct srat_cpu_affinity *c;
+    struct srat_memory_affinity *m;
+    struct srat_x2apic_affinity *x;
+    uint32_t node;
+
+    /* Nodes are only numbered from the SRAT. */
+    num_numa_nodes = 0;
+
+    p = (unsigned char *) (h + 1) + SRAT_RESERVED_SIZE;
+    end = (unsigned char *) h + h->length;
+
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case SRAT_CPU_AFFINITY:
+            c = (struct srat_cpu_affinity *) p;
+            if (c->length < sizeof(struct srat_cpu_affinity)
+                || !(c->flags & SRAT_ENABLED))
+                break;
+
+            if (domain_to_node((uint32_t) c->domain_low
+                        | (uint32_t) c->domain_high[0] << 8
+                        | (uint32_t) c->domain_high[1] << 16
+                        | (uint32_t) c->domain_high[2] << 24,
+                    &node))
+                return -1;
+
+            if (c->apic_id == boot_apic_id)
+                boot_node = node;
+
+            break;
+        case SRAT_X2APIC_AFFINITY:
+            x = (struct srat_x2apic_affinity *) p;
+            if (x->length < sizeof(struct srat_x2apic_affinity)
+                || !(x->flags & SRAT_ENABLED))
+                break;
+
+            if (domain_to_node(x->domain, &node))
+                return -1;
+
+            if (x->x2apic_id == boot_apic_id)
+                boot_node = node;
+
+            break;
+        case SRAT_MEMORY_AFFINITY:
+            m = (struct srat_memory_affinity *) p;
+            if (m->length < sizeof(struct srat_memory_affinity)
+                || !(m->flags & SRAT_ENABLED) || m->size == 0)
+                break;
+
+            if (num_numa_ranges == MAX_NUMA_RANGES) {
+                (void) k_printf("ERROR: ACPI: Too many NUMA ranges\n");
+                return -1;
+            }
+
+            if (domain_to_node(m->domain, &node))
+                return -1;
+
+            numa_range[num_numa_ranges].start_pa = m->base_pa;
+            numa_range[num_numa_ranges].end_pa_excl = m->base_pa + m->size;
+            numa_range[num_numa_ranges].node = node;
+            ++num_numa_ranges;
+
+            break;
+        }
+
+        p += p[1];
+    }
+
+    if (num_numa_nodes == 0)
+        num_numa_nodes = 1;
+
+    return 0;
+}
+
+static void parse_slit(struct sdt_header *h)
+{
+    /*
+     * The SLIT is a matrix of distances, indexed by proximity domain. It is
+     * ignored if it does not cover every domain.
+     */
+    uint64_t n;
+    uint8_t *entry;
+    uint32_t i, j;
+
+    if (h->length < sizeof(struct sdt_header) + sizeof(uint64_t))
+        return;
+
+    memcpy(&n, h + 1, sizeof(uint64_t));
+    entry = (uint8_t *) (h + 1) + sizeof(uint64_t);
+
+    if (n > U32_MAX || (uint64_t) (entry - (uint8_t *) h) + n * n > h->length)
+        return;
+
+    for (i = 0; i < num_numa_nodes; ++i)
+        if (node_domain[i] >= n)
+            return;
+
+    for (i = 0; i < num_numa_nodes; ++i)
+        for (j = 0; j < num_numa_nodes; ++j)
+            distance[i][j] = entry[node_domain[i] * n + node_domain[j]];
+}
+
+static int report_numa(void)
+{
+    uint32_t i, j;
+
+    if (k_printf("NUMA nodes: %u, boot CPU node: %u\n", num_numa_nodes,
+            boot_node)
+        == -1)
+        return -1;
+
+    for (i = 0; i < num_numa_ranges; ++i)
+        if (k_printf("%lx => %lx: Node %u\n",
+                (unsigned long) numa_range[i].start_pa,
+                (unsigned long) numa_range[i].end_pa_excl, numa_range[i].node)
+            == -1)
+            return -1;
+
+    for (i = 0; i < num_numa_nodes; ++i) {
+        if (k_printf("Node %u distances:", i) == -1)
+            return -1;
+
+        for (j = 0; j < num_numa_nodes; ++j)
+            if (k_printf(" %u", (uint32_t) distance[i][j]) == -1)
+                return -1;
+
+        if (k_printf("\n") == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int init_acpi(void)
+{
+    /*
+     * Reads the NUMA topology. Not finding the tables is not an error, as
+     * then there is a single node.
+     */
+    struct rsdp *r;
+    struct sdt_header *h;
+    uint32_t i, j;
+
+    for (i = 0; i < MAX_NUMA_NODES; ++i)
+        for (j = 0; j < MAX_NUMA_NODES; ++j)
+            distance[i][j] = i == j ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+
+    if ((r = find_rsdp()) == 0) {
+        (void) k_printf("ACPI: No RSDP\n");
+    } else if ((h = find_table(r, "SRAT")) == 0) {
+        (void) k_printf("ACPI: No SRAT\n");
+    } else {
+        if (parse_srat(h, read_local_apic_id()))
+            return -1;
+
+        if ((h = find_table(r, "SLIT")) != 0)
+            parse_slit(h);
+    }
+
+    return report_numa();
+}
+
+uint32_t count_numa_nodes(void)
+{
+    return num_numa_nodes;
+}
+
+uint32_t current_node(void)
+{
+    /* Only the boot CPU runs kernel code. */
+    return boot_node;
+}
+
+uint32_t find_numa_node(uint64_t pa, uint64_t *end_pa_excl)
+{
+    /*
+     * Returns the node of a physical address. *end_pa_excl is set to where
+     * the run of memory of that node, as seen in the SRAT, ends. Memory that
+     * the SRAT does not cover is put in node zero.
+     */
+    uint32_t i;
+    uint64_t e = U64_MAX;
+
+    for (i = 0; i < num_numa_ranges; ++i) {
+        if (pa >= numa_range[i].start_pa && pa < numa_range[i].end_pa_excl) {
+            *end_pa_excl = numa_range[i].end_pa_excl;
+            return numa_range[i].node;
+        }
+
+        /* The start of the next range above a gap. */
+        if (numa_range[i].start_pa > pa && numa_range[i].start_pa < e)
+            e = numa_range[i].start_pa;
+    }
+
+    *end_pa_excl = e;
+    return 0;
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to)
+{
+    return distance[from][to];
+}
@@ -25,36 +25,258 @@
 
 /*
  * Physical memory allocator.
+ *
+ * This is a binary buddy allocator. Memory is handed out in blocks of
+ * 2^order physically contiguous pages. Each order has a doubly linked list
+ * of free blocks. When a block is freed, it is merged with its buddy (the
+ * other half of the block of the next order up) for as long as the buddy
+ * is also free, so that large contiguous runs can form again.
+ *
+ * The bookkeeping lives in an array of page descriptors, one per page of
+ * physical memory, indexed by the page frame number (pfn). The array is
+ * placed in the first usable physical memory after the kernel. Only the
+ * descriptor at the start of a block is meaningful.
+ *
+ * Blocks are cleared before they are handed out, unless the caller says
+ * that it will overwrite them. Clearing a 2 MiB page is not cheap, so a
+ * small pool of already cleared pages is kept, which is refilled when the
+ * CPU would otherwise be idle.
+ *
+ * Paging structures and small user mappings only need 4 KiB, so there is
+ * also a frame allocator that carves pages into FRAMES_PER_PAGE frames.
+ * Each carved page keeps a header in its first frame, with a bitmap of the
+ * frames that are in use. Pages with free frames are kept on a doubly
+ * linked list, and a page goes back to the buddy allocator when all of its
+ * frames are free again.
+ *
+ * A page or frame can be shared, such as between the address spaces of a
+ * forked process, by adding references to it. Each free then drops a
+ * reference, and only the last one returns the memory.
+ *
+ * Physical memory is split into zones, so that devices that can only
+ * address low memory can still get it: DMA (below 16 MiB), DMA32 (below
+ * 4 GiB) and Normal (the rest). Each zone has its own free lists, and
+ * blocks only merge within a zone. An allocation is served from the highest
+ * zone that it allows, falling back to lower zones. A lower zone keeps a
+ * watermark of pages back from such fallback allocations, so that ordinary
+ * use cannot drain it.
+ *
+ * On a NUMA machine, each node has its own zones, and blocks only merge
+ * within a node. An allocation prefers a node, which is the node of the CPU
+ * unless the caller names one, and falls back to the other nodes in order
+ * of distance. Buddy allocations served by the preferred node are counted
+ * as hits, and the rest as misses. Carved pages are kept per node.
+ *
+ * Single pages are the most common request, so each CPU keeps magazines
+ * (small stacks) of free pages in front of the buddy allocator, which it
+ * can use without taking a lock. A CPU has a loaded and a previous
+ * magazine, and swaps between them before going further. Full and empty
+ * magazines are exchanged with a global depot, under a lock, so that pages
+ * move between CPUs a magazine at a time. Only when the depot has nothing
+ * to exchange does a CPU go to the buddy allocator. Cached pages are handed
+ * back to the buddy allocator when memory runs out. The magazines and the
+ * zero pool only hold pages from the top zone of the node of the CPU. They
+ * are never refilled from a lower zone, so an allocation that finds them
+ * empty goes to the buddy allocator, where the watermarks apply.
+ *
+ * This file also builds natively (without TOUCANIX) for the host test.
  */
 
 #include "allocator.h"
 #include "address.h"
+
+#ifdef TOUCANIX
+#include "acpi.h"
 #include "asm_lib.h"
 #include "defs.h"
 #include "k_printf.h"
+#else
+#include "test/test_defs.h"
+#include <stdio.h>
+#include <string.h>
+#endif
+
+/* Page descriptor flags. */
+#define PAGE_FREE   1
+#define PAGE_FRAMES (1 << 1) /* Carved into frames. */
+#define PAGE_CACHED (1 << 2) /* In a magazine. */
+
+/* Converts between physical addresses and page frame numbers. */
+#define pa_to_pfn(a) ((a) >> EXP_2_MIB)
+#define pfn_to_pa(n) ((uint64_t) (n) << EXP_2_MIB)
+
+/* Number of pages in a block of a given order. */
+#define order_pages(k) ((uint32_t) 1 << (k))
+
+/* Bits per frame bitmap word. */
+#define FRAME_BITMAP_BITS 64
+
+/* Number of cleared pages kept ready for allocation. */
+#define ZERO_POOL_SIZE 8
 
-#define MEMORY_TYPE_USABLE   1
-#define MEMORY_TYPE_RESERVED 2
+/* Zones. */
+#define ZONE_DMA    0
+#define ZONE_DMA32  1
+#define ZONE_NORMAL 2
+#define NUM_ZONES   3
 
-#define FREE_PAGE_SIGNATURE 0xC0FFEECAFE0FC0DE
+#define DMA32_START_PFN  pa_to_pfn((uint64_t) 16 << 20)
+#define NORMAL_START_PFN pa_to_pfn((uint64_t) 4 << 30)
 
-struct pa_range_descriptor {
-    uint64_t pa;
-    uint64_t size;
-    uint32_t type;
-} __attribute__((packed));
+#define zone_index(pfn)                                                       \
+    ((pfn) < DMA32_START_PFN ? ZONE_DMA                                       \
+            : (pfn) < NORMAL_START_PFN ? ZONE_DMA32                           \
+                                       : ZONE_NORMAL)
+
+/* The zone of a page, which needs the node in its descriptor to be set. */
+#define zone_of(pfn) (node[page_desc[pfn].node].zone + zone_index(pfn))
+
+/* Node named by the allocation flags, plus one, or zero if none. */
+#define flags_node(f) (((f) & ALLOC_NODE_MASK) >> ALLOC_NODE_SHIFT)
+
+/* Pages per magazine. */
+#define MAGAZINE_SIZE 16
+
+/* Magazines held by the depot, full or empty. */
+#define DEPOT_MAGAZINES (MAX_CPUS * 4)
+
+#ifdef TOUCANIX
+/* Only the boot CPU runs kernel code. */
+#define current_cpu() 0
 
 extern char end;
+#define KERNEL_END_VA ((uint64_t) &end)
+#endif
+
+struct page_descriptor {
+    /*
+     * Free list links. These are pfns, where zero indicates the end of the
+     * list, as the page at physical address zero is never handed out.
+     */
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    uint8_t node; /* NUMA node. */
+    uint16_t refs; /* References beyond the first, for a shared page. */
+};
+
+struct frame_header {
+    /* Set bits mark frames that are in use. Frame zero holds this header. */
+    uint64_t bitmap[FRAMES_PER_PAGE / FRAME_BITMAP_BITS];
+    /* Links for the list of carved pages that have free frames. */
+    uint64_t next_pa;
+    uint64_t prev_pa;
+    uint32_t used; /* Number of frames in use, excluding the header. */
+    /* References beyond the first, for each shared frame. */
+    uint16_t refs[FRAMES_PER_PAGE];
+};
+
+struct zone {
+    uint32_t end_pfn_excl;
+    /* The fraction of the zone that is kept back, as a divisor. */
+    uint32_t reserve_divisor;
+    /* Pages kept back from allocations that fall back to this zone. */
+    uint64_t watermark;
+    uint64_t num_pages; /* Managed by the allocator. */
+    uint64_t num_free_pages;
+    uint64_t fallbacks; /* Allocations that fell back to this zone. */
+    /* Head of the free list for each order. */
+    uint32_t free_list[PAGE_ORDERS];
+    uint64_t num_free_blocks[PAGE_ORDERS];
+};
+
+struct node {
+    struct zone zone[NUM_ZONES];
+    uint32_t top_zone; /* Highest zone with memory. */
+    /* Nodes to allocate from, in order of distance, starting with this. */
+    uint32_t fallback[MAX_NUMA_NODES];
+    /* Buddy allocations that preferred this node, and were served by it. */
+    uint64_t hits;
+    uint64_t misses; /* Served by another node instead. */
+    /* Carved pages of this node that have free frames. */
+    uint64_t frame_list_pa;
+};
+
+struct magazine {
+    uint32_t rounds; /* Number of pages held. */
+    uint64_t round[MAGAZINE_SIZE];
+};
+
+struct cpu_cache {
+    struct magazine *loaded;
+    struct magazine *previous;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t pad[4]; /* One cache line each. */
+};
+
+static struct page_descriptor *page_desc = 0;
+static uint64_t num_page_desc = 0;
+static uint64_t page_desc_start_pa = 0;
+static uint64_t page_desc_end_pa_excl = 0;
+
+static const char *zone_name[NUM_ZONES] = { "DMA", "DMA32", "Normal" };
+static const uint32_t zone_end_pfn_excl[NUM_ZONES]
+    = { DMA32_START_PFN, NORMAL_START_PFN, U32_MAX };
+
+/*
+ * DMA memory is only for callers that need it. DMA32 gives up 1/16 to
+ * ordinary allocations, when there is Normal memory to use instead.
+ */
+static const uint32_t zone_reserve_divisor[NUM_ZONES] = { 1, 16, 0 };
+
+static struct node node[MAX_NUMA_NODES];
+static uint32_t num_nodes = 1;
+
+/* Pages that have already been cleared, filled when the CPU is idle. */
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_used = 0;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
+/* Carved pages. */
+static uint64_t num_frame_pages = 0;
+static uint64_t num_used_frames = 0;
 
-static uint64_t head = 0;
 static uint64_t num_free_pages = 0;
 static uint64_t max_pages = 0;
 uint64_t max_pa_excl = 0;
 
+/* Magazines. */
+static struct magazine magazine[MAX_CPUS * 2 + DEPOT_MAGAZINES];
+static struct cpu_cache cpu_cache[MAX_CPUS];
+/* Full magazines are kept per node, so that they stay node-local. */
+static struct magazine *depot_full[MAX_NUMA_NODES][DEPOT_MAGAZINES];
+static struct magazine *depot_empty[DEPOT_MAGAZINES];
+static uint32_t num_depot_full[MAX_NUMA_NODES];
+static uint32_t num_depot_empty = 0;
+
+/*
+ * Locks. The frame lock is taken before the depot lock, which is taken
+ * before the allocator lock, which covers the buddy allocator and the zero
+ * pool.
+ */
+static int allocator_lock = 0;
+static int depot_lock = 0;
+static int frame_lock = 0;
+
+static void spin_lock(int *lock)
+{
+    while (__sync_lock_test_and_set(lock, 1))
+        while (*(volatile int *) lock);
+}
+
+static void spin_unlock(int *lock)
+{
+    __sync_lock_release(lock);
+}
+
 int print_memory_map_pa(void)
 {
-    uint32_t i, num_entries;
+    uint32_t i, num_entries, z, end_z, n;
     struct pa_range_descriptor *p;
+    uint64_t e;
     char *type_str;
 
     num_entries = *(uint32_t *) MEMORY_MAP_ENTRY_COUNT_VA;
@@ -72,84 +294,802 @@ int print_memory_map_pa(void)
             type_str = "Unknown";
             break;
         }
-        if (k_printf("%lx => %lx: %s\n", (unsigned long) p->pa,
+        if (k_printf("%lx => %lx: %s", (unsigned long) p->pa,
                 (unsigned long) p->pa + p->size, type_str)
             == -1)
             return -1;
 
+        /* Node and zones that the range starts in and spans. */
+        if (p->size) {
+            n = find_numa_node(p->pa, &e);
+            z = zone_index(pa_to_pfn(p->pa));
+            end_z = zone_index(pa_to_pfn(p->pa + p->size - 1));
+
+            if (k_printf(" (Node %u: %s", n, zone_name[z]) == -1)
+                return -1;
+
+            while (z++ < end_z)
+                if (k_printf(", %s", zone_name[z]) == -1)
+                    return -1;
+
+            if (k_printf(")") == -1)
+                return -1;
+        }
+
+        if (k_printf("\n") == -1)
+            return -1;
+
         ++p;
     }
 
     return 0;
 }
 
-void free_page_pa(uint64_t start_page_pa)
+static void push_free_block(uint32_t pfn, uint32_t order)
+{
+    struct page_descriptor *d = page_desc + pfn;
+    struct zone *z = zone_of(pfn);
+
+    d->order = (uint8_t) order;
+    d->flags = PAGE_FREE;
+    d->prev = 0;
+    d->next = z->free_list[order];
+
+    if (z->free_list[order])
+        page_desc[z->free_list[order]].prev = pfn;
+
+    z->free_list[order] = pfn;
+    ++z->num_free_blocks[order];
+}
+
+static void remove_free_block(uint32_t pfn)
+{
+    struct page_descriptor *d = page_desc + pfn;
+    struct zone *z = zone_of(pfn);
+
+    if (d->prev)
+        page_desc[d->prev].next = d->next;
+    else
+        z->free_list[d->order] = d->next;
+
+    if (d->next)
+        page_desc[d->next].prev = d->prev;
+
+    --z->num_free_blocks[d->order];
+
+    d->next = 0;
+    d->prev = 0;
+    d->flags = 0;
+}
+
+static void put_pages_pa(uint64_t start_pa, uint32_t order)
+{
+    /* Returns a block to the free lists. Call with the allocator lock. */
+    uint32_t pfn, buddy;
+
+    pfn = (uint32_t) pa_to_pfn(start_pa);
+
+    num_free_pages += order_pages(order);
+    zone_of(pfn)->num_free_pages += order_pages(order);
+
+    if (num_free_pages > max_pages)
+        max_pages = num_free_pages;
+
+    /* Merge with the buddy for as long as it is a whole free block. */
+    while (order < PAGE_ORDERS - 1) {
+        buddy = pfn ^ order_pages(order);
+
+        if (buddy >= num_page_desc || !(page_desc[buddy].flags & PAGE_FREE)
+            || page_desc[buddy].order != order
+            || page_desc[buddy].node != page_desc[pfn].node
+            || zone_index(buddy) != zone_index(pfn))
+            break;
+
+        remove_free_block(buddy);
+        pfn &= ~order_pages(order); /* The lower of the two. */
+        ++order;
+    }
+
+    push_free_block(pfn, order);
+}
+
+static uint64_t take_zone_pages_pa(struct zone *z, uint32_t order)
+{
+    /* Takes a block from the free lists of a zone. It is not cleared. */
+    uint32_t k, pfn;
+
+    /* Find the smallest free block that is big enough. */
+    k = order;
+    while (k < PAGE_ORDERS && !z->free_list[k]) ++k;
+
+    if (k == PAGE_ORDERS)
+        return 0; /* No more physical memory in this zone. */
+
+    pfn = z->free_list[k];
+    remove_free_block(pfn);
+
+    /* Split the block, returning the upper halves to the free lists. */
+    while (k > order) {
+        --k;
+        page_desc[pfn + order_pages(k)].node = page_desc[pfn].node;
+        push_free_block(pfn + order_pages(k), k);
+    }
+
+    /* Remember the order so that it can be checked when freed. */
+    page_desc[pfn].order = (uint8_t) order;
+
+    num_free_pages -= order_pages(order);
+    z->num_free_pages -= order_pages(order);
+
+    return pfn_to_pa(pfn);
+}
+
+static uint32_t preferred_node(uint32_t flags)
+{
+    uint32_t n = flags_node(flags);
+
+    return n && n <= num_nodes ? n - 1 : current_node();
+}
+
+static int use_caches(uint32_t flags)
+{
+    /* Checks if an allocation can be served by the magazines. */
+    return !(flags & (ALLOC_DMA | ALLOC_DMA32))
+        && preferred_node(flags) == current_node();
+}
+
+static uint64_t take_node_pages_pa(
+    struct node *n, uint32_t order, uint32_t flags)
+{
+    /*
+     * Takes a block from the highest zone of a node that the flags allow,
+     * falling back to lower zones, as long as they stay above their
+     * watermarks.
+     */
+    uint32_t start_z, k;
+    struct zone *z;
+    uint64_t p;
+
+    if (flags & ALLOC_DMA)
+        start_z = ZONE_DMA;
+    else if (flags & ALLOC_DMA32)
+        start_z = ZONE_DMA32;
+    else
+        start_z = ZONE_NORMAL;
+
+    if (start_z > n->top_zone)
+        start_z = n->top_zone;
+
+    k = start_z + 1;
+    while (k--) {
+        z = n->zone + k;
+
+        if (k != start_z
+            && z->num_free_pages < z->watermark + order_pages(order))
+            continue;
+
+        if ((p = take_zone_pages_pa(z, order))) {
+            if (k != start_z)
+                ++z->fallbacks;
+
+            return p;
+        }
+    }
+
+    return 0; /* No more physical memory in this node. */
+}
+
+static uint64_t take_top_zone_page_pa(uint32_t n)
+{
+    /* Takes a page for the caches, without falling back to lower zones. */
+    return take_zone_pages_pa(node[n].zone + node[n].top_zone, 0);
+}
+
+static uint64_t take_pages_pa(uint32_t order, uint32_t flags)
+{
+    /*
+     * Takes a block from the preferred node, or else from the nearest node
+     * that has one. Call with the allocator lock.
+     */
+    struct node *pref;
+    uint32_t i;
+    uint64_t p;
+
+    if (order >= PAGE_ORDERS)
+        return 0;
+
+    pref = node + preferred_node(flags);
+
+    for (i = 0; i < num_nodes; ++i)
+        if ((p = take_node_pages_pa(node + pref->fallback[i], order, flags))) {
+            if (i == 0)
+                ++pref->hits;
+            else
+                ++pref->misses;
+
+            return p;
+        }
+
+    return 0; /* No more physical memory. */
+}
+
+static void put_magazine(struct magazine *m)
+{
+    /* Empties a magazine into the buddy allocator. */
+    uint64_t p;
+
+    spin_lock(&allocator_lock);
+
+    while (m->rounds) {
+        p = m->round[--m->rounds];
+        page_desc[pa_to_pfn(p)].flags &= ~PAGE_CACHED;
+        put_pages_pa(p, 0);
+    }
+
+    spin_unlock(&allocator_lock);
+}
+
+static void drain_caches(void)
+{
+    /*
+     * Gives the pages in the depot, the magazines of this CPU, and the zero
+     * pool back, so that they can merge with buddies. Pages in the
+     * magazines of other CPUs stay where they are.
+     */
+    struct cpu_cache *c = cpu_cache + current_cpu();
+    struct magazine *m;
+    uint32_t n;
+
+    spin_lock(&depot_lock);
+
+    for (n = 0; n < num_nodes; ++n)
+        while (num_depot_full[n]) {
+            m = depot_full[n][--num_depot_full[n]];
+            put_magazine(m);
+            depot_empty[num_depot_empty++] = m;
+        }
+
+    spin_unlock(&depot_lock);
+
+    put_magazine(c->loaded);
+    put_magazine(c->previous);
+
+    spin_lock(&allocator_lock);
+
+    while (zero_pool_used) put_pages_pa(zero_pool[--zero_pool_used], 0);
+
+    spin_unlock(&allocator_lock);
+}
+
+static uint64_t allocate_cached_page_pa(void)
+{
+    /* Takes a page from the magazines of this CPU, refilling if needed. */
+    struct cpu_cache *c = cpu_cache + current_cpu();
+    uint32_t n = current_node();
+    struct magazine *m;
+    uint64_t p;
+
+    if (!c->loaded->rounds && c->previous->rounds) {
+        m = c->loaded;
+        c->loaded = c->previous;
+        c->previous = m;
+    }
+
+    if (!c->loaded->rounds) {
+        /* Exchange the empty magazine for a full one. */
+        spin_lock(&depot_lock);
+
+        if (num_depot_full[n]) {
+            depot_empty[num_depot_empty++] = c->loaded;
+            c->loaded = depot_full[n][--num_depot_full[n]];
+        }
+
+        spin_unlock(&depot_lock);
+    }
+
+    if (!c->loaded->rounds) {
+        /* Fill half of the magazine from the buddy allocator. */
+        ++c->misses;
+        spin_lock(&allocator_lock);
+
+        while (c->loaded->rounds < MAGAZINE_SIZE / 2
+            && (p = take_top_zone_page_pa(n))) {
+            ++node[n].hits;
+            page_desc[pa_to_pfn(p)].flags |= PAGE_CACHED;
+            c->loaded->round[c->loaded->rounds++] = p;
+        }
+
+        spin_unlock(&allocator_lock);
+
+        if (!c->loaded->rounds)
+            return 0;
+    } else {
+        ++c->hits;
+    }
+
+    p = c->loaded->round[--c->loaded->rounds];
+    page_desc[pa_to_pfn(p)].flags &= ~PAGE_CACHED;
+
+    return p;
+}
+
+static void free_cached_page_pa(uint64_t p)
 {
+    /* Puts a page into the magazines of this CPU, emptying if needed. */
+    struct cpu_cache *c = cpu_cache + current_cpu();
+    uint32_t n = current_node();
+    struct magazine *m;
+
+    if (c->loaded->rounds == MAGAZINE_SIZE
+        && c->previous->rounds < MAGAZINE_SIZE) {
+        m = c->loaded;
+        c->loaded = c->previous;
+        c->previous = m;
+    }
+
+    if (c->loaded->rounds == MAGAZINE_SIZE) {
+        /* Exchange the full magazine for an empty one. */
+        spin_lock(&depot_lock);
+
+        if (num_depot_empty) {
+            depot_full[n][num_depot_full[n]++] = c->loaded;
+            c->loaded = depot_empty[--num_depot_empty];
+        }
+
+        spin_unlock(&depot_lock);
+    }
+
+    /* The depot is full, so the magazine goes back to the buddy allocator. */
+    if (c->loaded->rounds == MAGAZINE_SIZE)
+        put_magazine(c->loaded);
+
+    page_desc[pa_to_pfn(p)].flags |= PAGE_CACHED;
+    c->loaded->round[c->loaded->rounds++] = p;
+}
+
+void free_pages_pa(uint64_t start_pa, uint32_t order)
+{
+    uint32_t pfn;
+    int shared;
+
     /*
      * Page starting at physical address zero cannot be used,
      * as it clashes with the indication of no more memory.
      */
-    if (start_page_pa == 0)
+    if (start_pa == 0)
         return;
 
-    *(uint64_t *) pa_to_va(start_page_pa) = head;
-    *(uint64_t *) pa_to_va(start_page_pa + sizeof(uint64_t))
-        = FREE_PAGE_SIGNATURE;
+    pfn = (uint32_t) pa_to_pfn(start_pa);
 
-    head = start_page_pa;
-    ++num_free_pages;
+    if (order >= PAGE_ORDERS || start_pa % PAGE_SIZE
+        || pfn & (order_pages(order) - 1) || pfn >= num_page_desc
+        || page_desc[pfn].order != order) {
+        (void) k_printf("ERROR: Physical memory: Invalid free: %lx\n",
+            (unsigned long) start_pa);
+        return;
+    }
 
-    if (num_free_pages > max_pages)
-        max_pages = num_free_pages;
+    if (page_desc[pfn].flags & (PAGE_FREE | PAGE_CACHED)) {
+        (void) k_printf("ERROR: Physical memory: Double free: %lx\n",
+            (unsigned long) start_pa);
+        return;
+    }
+
+    /* A shared page only loses a reference. */
+    spin_lock(&allocator_lock);
+
+    shared = page_desc[pfn].refs != 0;
+    if (shared)
+        --page_desc[pfn].refs;
+
+    spin_unlock(&allocator_lock);
+
+    if (shared)
+        return;
+
+    if (order == 0 && page_desc[pfn].node == current_node()
+        && zone_index(pfn) == node[current_node()].top_zone) {
+        free_cached_page_pa(start_pa);
+        return;
+    }
+
+    spin_lock(&allocator_lock);
+    put_pages_pa(start_pa, order);
+    spin_unlock(&allocator_lock);
+}
+
+uint64_t allocate_pages_pa(uint32_t order, uint32_t flags)
+{
+    /* Returns the physical address of the start of the block. */
+    uint64_t p = 0;
+
+    if (order == 0 && !(flags & ALLOC_NO_ZERO) && use_caches(flags)) {
+        spin_lock(&allocator_lock);
+
+        if (zero_pool_used) {
+            ++zero_pool_hits;
+            p = zero_pool[--zero_pool_used];
+        } else {
+            ++zero_pool_misses;
+        }
+
+        spin_unlock(&allocator_lock);
+
+        if (p)
+            return p;
+    }
+
+    if (order == 0 && use_caches(flags))
+        p = allocate_cached_page_pa();
+
+    if (!p) {
+        /* Magazines are only filled from the node of the CPU. */
+        spin_lock(&allocator_lock);
+        p = take_pages_pa(order, flags);
+        spin_unlock(&allocator_lock);
+    }
+
+    if (!p) {
+        /* Take back the cached pages and try again. */
+        drain_caches();
+
+        spin_lock(&allocator_lock);
+        p = take_pages_pa(order, flags);
+        spin_unlock(&allocator_lock);
+
+        if (!p)
+            return 0; /* No more physical memory. */
+    }
+
+    /* Clear block. */
+    if (!(flags & ALLOC_NO_ZERO))
+        memset((void *) pa_to_va(p), 0, (uint64_t) PAGE_SIZE << order);
+
+    return p;
+}
+
+int refill_zero_pool(void)
+{
+    /*
+     * Clears one free page and adds it to the pool, taking the cost of
+     * clearing off the allocation path. Called when the CPU would otherwise
+     * be idle. Returns 1 if a page was added, and 0 if there is nothing
+     * left to do.
+     */
+    uint64_t p = 0;
+
+    spin_lock(&allocator_lock);
+
+    if (zero_pool_used < ZERO_POOL_SIZE
+        && (p = take_top_zone_page_pa(current_node())))
+        ++node[current_node()].hits;
+
+    spin_unlock(&allocator_lock);
+
+    if (!p)
+        return 0;
+
+    memset((void *) pa_to_va(p), 0, (uint64_t) PAGE_SIZE);
+
+    spin_lock(&allocator_lock);
+
+    if (zero_pool_used < ZERO_POOL_SIZE) {
+        zero_pool[zero_pool_used++] = p;
+        p = 0;
+    } else {
+        put_pages_pa(p, 0); /* Filled by another CPU in the meantime. */
+    }
 
-    if (start_page_pa + PAGE_SIZE > max_pa_excl)
-        max_pa_excl = start_page_pa + PAGE_SIZE;
+    spin_unlock(&allocator_lock);
+
+    return p == 0;
+}
+
+void free_page_pa(uint64_t start_page_pa)
+{
+    free_pages_pa(start_page_pa, 0);
 }
 
 uint64_t allocate_page_pa(void)
 {
     /* Returns the physical address of the start of the page. */
-    uint64_t p;
+    return allocate_pages_pa(0, 0);
+}
 
-    if (head == 0 || num_free_pages == 0)
-        return 0; /* No more physical memory. */
+static void push_frame_page(uint64_t page_pa)
+{
+    struct frame_header *h = (struct frame_header *) pa_to_va(page_pa);
+    struct node *n = node + page_desc[pa_to_pfn(page_pa)].node;
 
-    p = head;
+    h->prev_pa = 0;
+    h->next_pa = n->frame_list_pa;
 
-    /* Update head to the next page in the linked list. */
-    head = *(uint64_t *) pa_to_va(head);
+    if (n->frame_list_pa)
+        ((struct frame_header *) pa_to_va(n->frame_list_pa))->prev_pa
+            = page_pa;
 
-    /* Clear page. */
-    memset((void *) pa_to_va(p), 0, (uint64_t) PAGE_SIZE);
+    n->frame_list_pa = page_pa;
+}
+
+static void remove_frame_page(uint64_t page_pa)
+{
+    struct frame_header *h = (struct frame_header *) pa_to_va(page_pa);
+    struct node *n = node + page_desc[pa_to_pfn(page_pa)].node;
+
+    if (h->prev_pa)
+        ((struct frame_header *) pa_to_va(h->prev_pa))->next_pa = h->next_pa;
+    else
+        n->frame_list_pa = h->next_pa;
+
+    if (h->next_pa)
+        ((struct frame_header *) pa_to_va(h->next_pa))->prev_pa = h->prev_pa;
+
+    h->next_pa = 0;
+    h->prev_pa = 0;
+}
+
+uint64_t allocate_frame_pa(uint32_t flags)
+{
+    /* Returns the physical address of the start of a 4 KiB frame. */
+    struct frame_header *h;
+    uint64_t page_pa, p;
+    uint32_t i, j;
+
+    spin_lock(&frame_lock);
+
+    page_pa = node[preferred_node(flags)].frame_list_pa;
+
+    if (!page_pa) {
+        /*
+         * Carve a new page. It goes on the list of its own node, which is
+         * only another node when the preferred node has run out.
+         */
+        if (!(page_pa = allocate_pages_pa(
+                  0, ALLOC_NO_ZERO | (flags & ALLOC_NODE_MASK)))) {
+            spin_unlock(&frame_lock);
+            return 0;
+        }
+
+        h = (struct frame_header *) pa_to_va(page_pa);
+        memset(h, 0, sizeof(struct frame_header));
+        h->bitmap[0] = 1; /* Frame zero holds the header. */
+
+        page_desc[pa_to_pfn(page_pa)].flags |= PAGE_FRAMES;
+        push_frame_page(page_pa);
+        ++num_frame_pages;
+    }
 
-    --num_free_pages;
+    h = (struct frame_header *) pa_to_va(page_pa);
+
+    /* Find the first free frame. */
+    i = 0;
+    while (h->bitmap[i] == U64_MAX) ++i;
+
+    j = 0;
+    while (h->bitmap[i] >> j & 1) ++j;
+
+    h->bitmap[i] |= (uint64_t) 1 << j;
+    ++h->used;
+    ++num_used_frames;
+
+    if (h->used == FRAMES_PER_PAGE - 1)
+        remove_frame_page(page_pa); /* Full. */
+
+    p = page_pa + ((uint64_t) (i * FRAME_BITMAP_BITS + j) << EXP_4_KIB);
+
+    spin_unlock(&frame_lock);
+
+    /* Clear frame. */
+    if (!(flags & ALLOC_NO_ZERO))
+        memset((void *) pa_to_va(p), 0, (uint64_t) FRAME_SIZE);
 
     return p;
 }
 
-int check_physical_memory(void)
+void free_frame_pa(uint64_t frame_pa)
 {
-    uint64_t h, check_num_free_pages = 0;
+    struct frame_header *h;
+    uint64_t page_pa, pfn;
+    uint32_t n;
+
+    if (frame_pa == 0)
+        return;
 
-    h = head;
+    page_pa = truncate_to_page(frame_pa);
+    pfn = pa_to_pfn(page_pa);
+    n = (uint32_t) ((frame_pa - page_pa) >> EXP_4_KIB);
+    h = (struct frame_header *) pa_to_va(page_pa);
 
-    while (h != 0) {
-        if (h % PAGE_SIZE) {
-            (void) k_printf("ERROR: Physical memory: Page not aligned: %lx\n",
-                (unsigned long) h);
-            return -1;
+    spin_lock(&frame_lock);
+
+    if (frame_pa % FRAME_SIZE || n == 0 || pfn >= num_page_desc
+        || !(page_desc[pfn].flags & PAGE_FRAMES)
+        || !(h->bitmap[n / FRAME_BITMAP_BITS] >> n % FRAME_BITMAP_BITS & 1)) {
+        spin_unlock(&frame_lock);
+        (void) k_printf("ERROR: Physical memory: Invalid frame free: %lx\n",
+            (unsigned long) frame_pa);
+        return;
+    }
+
+    /* A shared frame only loses a reference. */
+    if (h->refs[n]) {
+        --h->refs[n];
+        spin_unlock(&frame_lock);
+        return;
+    }
+
+    /* A full page goes back on the list. */
+    if (h->used == FRAMES_PER_PAGE - 1)
+        push_frame_page(page_pa);
+
+    h->bitmap[n / FRAME_BITMAP_BITS]
+        &= ~((uint64_t) 1 << n % FRAME_BITMAP_BITS);
+    --h->used;
+    --num_used_frames;
+
+    /* Return an empty page, unless it is the only one with free frames. */
+    if (!h->used && (h->prev_pa || h->next_pa)) {
+        remove_frame_page(page_pa);
+        page_desc[pfn].flags &= ~PAGE_FRAMES;
+        free_page_pa(page_pa);
+        --num_frame_pages;
+    }
+
+    spin_unlock(&frame_lock);
+}
+
+static uint16_t *find_refs(uint64_t pa)
+{
+    /*
+     * Returns the extra reference count of an allocated page (of order zero)
+     * or frame, or 0 if the address is not the start of one. The caller
+     * holds the frame and allocator locks.
+     */
+    struct frame_header *h;
+    uint64_t pfn;
+    uint32_t n;
+
+    pfn = pa_to_pfn(pa);
+    if (pa == 0 || pfn >= num_page_desc)
+        return 0;
+
+    if (page_desc[pfn].flags & PAGE_FRAMES) {
+        h = (struct frame_header *) pa_to_va(truncate_to_page(pa));
+        n = (uint32_t) ((pa % PAGE_SIZE) >> EXP_4_KIB);
+
+        if (pa % FRAME_SIZE || n == 0
+            || !(h->bitmap[n / FRAME_BITMAP_BITS] >> n % FRAME_BITMAP_BITS
+                & 1))
+            return 0;
+
+        return h->refs + n;
+    }
+
+    if (pa % PAGE_SIZE || page_desc[pfn].order != 0
+        || page_desc[pfn].flags & (PAGE_FREE | PAGE_CACHED))
+        return 0;
+
+    return &page_desc[pfn].refs;
+}
+
+int share_pa(uint64_t pa)
+{
+    /*
+     * Adds a reference to an allocated page or frame, so that it is only
+     * freed once every holder has freed it. Returns -1 if it cannot be
+     * shared.
+     */
+    uint16_t *refs;
+    int ret = -1;
+
+    spin_lock(&frame_lock);
+    spin_lock(&allocator_lock);
+
+    refs = find_refs(pa);
+    if (refs != 0 && *refs != U16_MAX) {
+        ++*refs;
+        ret = 0;
+    }
+
+    spin_unlock(&allocator_lock);
+    spin_unlock(&frame_lock);
+
+    if (ret)
+        (void) k_printf("ERROR: Physical memory: Cannot share: %lx\n",
+            (unsigned long) pa);
+
+    return ret;
+}
+
+uint32_t count_references_pa(uint64_t pa)
+{
+    /*
+     * Returns the number of holders of an allocated page or frame, or 0 if
+     * the address is not the start of one.
+     */
+    uint16_t *refs;
+    uint32_t count = 0;
+
+    spin_lock(&frame_lock);
+    spin_lock(&allocator_lock);
+
+    refs = find_refs(pa);
+    if (refs != 0)
+        count = (uint32_t) *refs + 1;
+
+    spin_unlock(&allocator_lock);
+    spin_unlock(&frame_lock);
+
+    return count;
+}
+
+static int check_zone(uint32_t n, uint32_t zi, uint64_t *free_pages)
+{
+    /* Checks the free lists of a zone, adding up its free pages. */
+    struct zone *z = node[n].zone + zi;
+    uint64_t check_num_free_blocks, check_zone_free_pages = 0;
+    uint32_t k, pfn, prev;
+
+    for (k = 0; k < PAGE_ORDERS; ++k) {
+        check_num_free_blocks = 0;
+        prev = 0;
+        pfn = z->free_list[k];
+
+        while (pfn != 0) {
+            if (pfn >= num_page_desc || pfn & (order_pages(k) - 1)
+                || page_desc[pfn].node != n || zone_index(pfn) != zi) {
+                (void) k_printf(
+                    "ERROR: Physical memory: Block not aligned: %lx\n",
+                    (unsigned long) pfn_to_pa(pfn));
+                return -1;
+            }
+
+            if (!(page_desc[pfn].flags & PAGE_FREE)
+                || page_desc[pfn].order != k
+                || page_desc[pfn].prev != prev) {
+                (void) k_printf(
+                    "ERROR: Physical memory: Invalid descriptor: %lx\n",
+                    (unsigned long) pfn_to_pa(pfn));
+                return -1;
+            }
+
+            prev = pfn;
+            pfn = page_desc[pfn].next; /* Next. */
+            ++check_num_free_blocks;
+            check_zone_free_pages += order_pages(k);
         }
 
-        if (*(uint64_t *) pa_to_va(h + sizeof(uint64_t))
-            != (uint64_t) FREE_PAGE_SIGNATURE) {
-            (void) k_printf("ERROR: Physical memory: Invalid signature\n");
+        if (check_num_free_blocks != z->num_free_blocks[k]) {
+            (void) k_printf("ERROR: Physical memory: Mismatch in number of "
+                            "free blocks of order %lu in node %u zone %s\n",
+                (unsigned long) k, n, zone_name[zi]);
             return -1;
         }
+    }
 
-        h = *(uint64_t *) pa_to_va(h); /* Next. */
-        ++check_num_free_pages;
+    if (check_zone_free_pages != z->num_free_pages) {
+        (void) k_printf("ERROR: Physical memory: Mismatch in number of free "
+                        "pages in node %u zone %s\n",
+            n, zone_name[zi]);
+        return -1;
     }
 
+    *free_pages += check_zone_free_pages;
+
+    return 0;
+}
+
+int check_physical_memory(void)
+{
+    uint32_t k, i, n;
+    uint64_t check_num_free_pages = 0, p;
+    struct frame_header *h;
+
+    for (n = 0; n < num_nodes; ++n)
+        for (k = 0; k < NUM_ZONES; ++k)
+            if (check_zone(n, k, &check_num_free_pages))
+                return -1;
+
     if (check_num_free_pages != num_free_pages) {
         (void) k_printf(
             "ERROR: Physical memory: Mismatch in number of free pages\n");
@@ -160,63 +1100,370 @@ int check_physical_memory(void)
         return -1;
     }
 
+    for (k = 0; k < MAX_CPUS * 2 + DEPOT_MAGAZINES; ++k)
+        for (i = 0; i < magazine[k].rounds; ++i)
+            if (!(page_desc[pa_to_pfn(magazine[k].round[i])].flags
+                    & PAGE_CACHED)) {
+                (void) k_printf(
+                    "ERROR: Physical memory: Invalid cached page: %lx\n",
+                    (unsigned long) magazine[k].round[i]);
+                return -1;
+            }
+
+    for (n = 0; n < num_nodes; ++n)
+        for (p = node[n].frame_list_pa; p != 0; p = h->next_pa) {
+            h = (struct frame_header *) pa_to_va(p);
+
+            if (!(page_desc[pa_to_pfn(p)].flags & PAGE_FRAMES)
+                || page_desc[pa_to_pfn(p)].node != n
+                || h->used >= FRAMES_PER_PAGE - 1 || !(h->bitmap[0] & 1)) {
+                (void) k_printf(
+                    "ERROR: Physical memory: Invalid frame page: %lx\n",
+                    (unsigned long) p);
+                return -1;
+            }
+        }
+
     (void) k_printf("Memory check OK\n");
     return 0;
 }
 
-static void free_range_va(uint64_t start_va, uint64_t size)
+static int find_usable_page_range_pa(struct pa_range_descriptor *p,
+    uint64_t *start_page_pa, uint64_t *end_page_pa_excl)
 {
     /*
-     * Range can be huge with the upper bound only limited by the GiB page size
-     * mapping established in the loader.asm file.
+     * Gets the usable page range of a memory map entry. Cannot use memory
+     * below the kernel code, and the upper bound is limited by the GiB page
+     * size mapping established in the loader.asm file. Returns -1 if there
+     * are no whole pages.
      */
-    uint64_t end_va_excl, start_page_va, end_page_va_excl, v;
+    uint64_t start_pa, end_pa_excl;
 
-    end_va_excl = start_va + size;
+    if (p->type != MEMORY_TYPE_USABLE)
+        return -1;
 
-    /* Cannot use memory below the kernel code. */
-    if (start_va < (uint64_t) &end)
-        start_va = (uint64_t) &end;
+    start_pa = p->pa;
+    end_pa_excl = p->pa + p->size;
 
-    if (end_va_excl > MAX_MAPPED_VA_EXCL)
-        end_va_excl = MAX_MAPPED_VA_EXCL;
+    if (start_pa < va_to_pa(KERNEL_END_VA))
+        start_pa = va_to_pa(KERNEL_END_VA);
 
-    /* Find subset page range -- a potentially narrower range. */
-    start_page_va = align_to_page(start_va);
-    end_page_va_excl = truncate_to_page(end_va_excl);
+    if (end_pa_excl > va_to_pa(MAX_MAPPED_VA_EXCL))
+        end_pa_excl = va_to_pa(MAX_MAPPED_VA_EXCL);
 
-    if (end_page_va_excl <= start_page_va)
-        return;
+    *start_page_pa = align_to_page(start_pa);
+    *end_page_pa_excl = truncate_to_page(end_pa_excl);
+
+    if (*end_page_pa_excl <= *start_page_pa)
+        return -1;
+
+    return 0;
+}
+
+static void init_nodes(void)
+{
+    /*
+     * Clears the zones of each node, and orders the other nodes by their
+     * distance from it, for fallback.
+     */
+    struct node *n;
+    uint32_t i, j, k, t, d;
+
+    num_nodes = count_numa_nodes();
+    if (num_nodes > MAX_NUMA_NODES)
+        num_nodes = MAX_NUMA_NODES;
+
+    memset(node, 0, sizeof(node));
+
+    for (i = 0; i < num_nodes; ++i) {
+        n = node + i;
+
+        for (k = 0; k < NUM_ZONES; ++k) {
+            n->zone[k].end_pfn_excl = zone_end_pfn_excl[k];
+            n->zone[k].reserve_divisor = zone_reserve_divisor[k];
+        }
+
+        n->top_zone = ZONE_DMA;
+
+        /* Insertion sort by distance, where ties go to the lower node. */
+        n->fallback[0] = i;
+        for (j = 0, k = 1; j < num_nodes; ++j) {
+            if (j == i)
+                continue;
+
+            d = numa_distance(i, j);
+            t = k++;
+            while (t > 1 && numa_distance(i, n->fallback[t - 1]) > d) {
+                n->fallback[t] = n->fallback[t - 1];
+                --t;
+            }
+
+            n->fallback[t] = j;
+        }
+    }
+}
+
+static void init_magazines(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_CPUS; ++i) {
+        cpu_cache[i].loaded = magazine + 2 * i;
+        cpu_cache[i].previous = magazine + 2 * i + 1;
+        cpu_cache[i].hits = 0;
+        cpu_cache[i].misses = 0;
+    }
+
+    for (i = 0; i < DEPOT_MAGAZINES; ++i)
+        depot_empty[i] = magazine + 2 * MAX_CPUS + i;
+
+    for (i = 0; i < MAX_CPUS * 2 + DEPOT_MAGAZINES; ++i)
+        magazine[i].rounds = 0;
+
+    memset(num_depot_full, 0, sizeof(num_depot_full));
+    num_depot_empty = DEPOT_MAGAZINES;
+}
+
+static int init_page_descriptors(void)
+{
+    /*
+     * Finds the extent of physical memory, then places the page descriptor
+     * array in the first usable range that is big enough to hold it.
+     */
+    uint32_t i, num_entries;
+    struct pa_range_descriptor *p;
+    uint64_t s, e, size;
+
+    num_entries = *(uint32_t *) MEMORY_MAP_ENTRY_COUNT_VA;
+
+    p = (struct pa_range_descriptor *) MEMORY_MAP_VA;
+    for (i = 0; i < num_entries; ++i) {
+        if (!find_usable_page_range_pa(p, &s, &e) && e > max_pa_excl)
+            max_pa_excl = e;
+
+        ++p;
+    }
+
+    num_page_desc = pa_to_pfn(max_pa_excl);
+    size = align_to_page(num_page_desc * sizeof(struct page_descriptor));
+
+    p = (struct pa_range_descriptor *) MEMORY_MAP_VA;
+    for (i = 0; i < num_entries; ++i) {
+        if (!find_usable_page_range_pa(p, &s, &e) && e - s >= size) {
+            page_desc_start_pa = s;
+            page_desc_end_pa_excl = s + size;
+            page_desc = (struct page_descriptor *) pa_to_va(s);
+
+            memset(page_desc, 0, size);
+            init_nodes();
+            zero_pool_used = 0;
+            init_magazines();
+
+            return 0;
+        }
+
+        ++p;
+    }
+
+    (void) k_printf("ERROR: Physical memory: No room for page descriptors\n");
+    return -1;
+}
+
+static uint32_t count_depot_full(void)
+{
+    uint32_t n = 0, i;
+
+    for (i = 0; i < num_nodes; ++i) n += num_depot_full[i];
+
+    return n;
+}
+
+static uint64_t count_cached_pages(void)
+{
+    uint64_t n;
+    uint32_t i;
+
+    n = (uint64_t) count_depot_full() * MAGAZINE_SIZE;
+
+    for (i = 0; i < MAX_CPUS; ++i)
+        n += cpu_cache[i].loaded->rounds + cpu_cache[i].previous->rounds;
+
+    return n;
+}
+
+static int report_zone(struct zone *z, uint32_t zi)
+{
+    uint32_t k;
+
+    if (k_printf("  Zone %s: free: %lu, used: %lu, watermark: %lu, "
+                 "fallbacks: %lu\n",
+            zone_name[zi], (unsigned long) z->num_free_pages,
+            (unsigned long) (z->num_pages - z->num_free_pages),
+            (unsigned long) z->watermark, (unsigned long) z->fallbacks)
+        == -1)
+        return -1;
+
+    if (k_printf("    Free blocks per order:") == -1)
+        return -1;
 
-    for (v = start_page_va; v < end_page_va_excl; v += PAGE_SIZE)
-        free_page_pa(va_to_pa(v));
+    for (k = 0; k < PAGE_ORDERS; ++k)
+        if (k_printf(" %lu", (unsigned long) z->num_free_blocks[k]) == -1)
+            return -1;
+
+    if (k_printf("\n") == -1)
+        return -1;
+
+    return 0;
 }
 
 int report_physical_memory(void)
 {
-    if (k_printf("Used physical pages: %lu/%lu\n",
+    uint32_t k, n;
+    uint64_t hits = 0, misses = 0;
+
+    if (k_printf("Free physical pages: %lu/%lu\n",
             (unsigned long) num_free_pages, (unsigned long) max_pages)
         == -1)
         return -1;
 
+    for (n = 0; n < num_nodes; ++n) {
+        if (k_printf("Node %u: hits: %lu, misses: %lu\n", n,
+                (unsigned long) node[n].hits, (unsigned long) node[n].misses)
+            == -1)
+            return -1;
+
+        for (k = 0; k < NUM_ZONES; ++k)
+            if (report_zone(node[n].zone + k, k))
+                return -1;
+    }
+
+    if (k_printf("Used frames: %lu in %lu pages\n",
+            (unsigned long) num_used_frames, (unsigned long) num_frame_pages)
+        == -1)
+        return -1;
+
+    for (k = 0; k < MAX_CPUS; ++k) {
+        hits += cpu_cache[k].hits;
+        misses += cpu_cache[k].misses;
+    }
+
+    if (k_printf("Magazines: %lu pages, %lu/%lu full in depot, hits: %lu, "
+                 "misses: %lu\n",
+            (unsigned long) count_cached_pages(),
+            (unsigned long) count_depot_full(),
+            (unsigned long) DEPOT_MAGAZINES,
+            (unsigned long) hits, (unsigned long) misses)
+        == -1)
+        return -1;
+
+    if (k_printf("Zero pool: %lu/%lu, hits: %lu, misses: %lu\n",
+            (unsigned long) zero_pool_used, (unsigned long) ZERO_POOL_SIZE,
+            (unsigned long) zero_pool_hits, (unsigned long) zero_pool_misses)
+        == -1)
+        return -1;
+
     return 0;
 }
 
+uint64_t count_free_physical_memory(void)
+{
+    /*
+     * Returns the number of free bytes, including the pages in the zero pool
+     * and the magazines, and the carved pages, less their used frames. This
+     * does not depend on how many empty carved pages are kept.
+     */
+    return ((num_free_pages + zero_pool_used + count_cached_pages())
+               << EXP_2_MIB)
+        + ((num_frame_pages * FRAMES_PER_PAGE - num_used_frames)
+            << EXP_4_KIB);
+}
+
+static void free_range_pa(uint64_t start_pa, uint64_t end_pa_excl)
+{
+    /*
+     * Frees a page range as the largest aligned blocks that fit, so the work
+     * depends on the number of blocks, not on the size of the range. Only
+     * the descriptor at the head of each block is written.
+     */
+    uint32_t pfn, end_pfn_excl, e, k, n;
+    uint64_t node_end_pa_excl;
+    struct zone *z;
+
+    pfn = (uint32_t) pa_to_pfn(start_pa);
+    end_pfn_excl = (uint32_t) pa_to_pfn(end_pa_excl);
+
+    while (pfn < end_pfn_excl) {
+        /* Blocks do not cross zones or nodes. */
+        n = find_numa_node(pfn_to_pa(pfn), &node_end_pa_excl);
+        if (n >= num_nodes)
+            n = 0;
+
+        z = node[n].zone + zone_index(pfn);
+        e = end_pfn_excl < z->end_pfn_excl ? end_pfn_excl : z->end_pfn_excl;
+
+        /* A page that straddles nodes goes to the node of its start. */
+        if (node_end_pa_excl < pfn_to_pa(e))
+            e = (uint32_t) pa_to_pfn(node_end_pa_excl);
+
+        if (e <= pfn)
+            e = pfn + 1;
+
+        k = PAGE_ORDERS - 1;
+        while (pfn & (order_pages(k) - 1) || pfn + order_pages(k) > e) --k;
+
+        page_desc[pfn].order = (uint8_t) k;
+        page_desc[pfn].node = (uint8_t) n;
+        put_pages_pa(pfn_to_pa(pfn), k);
+
+        z->num_pages += order_pages(k);
+        if (zone_index(pfn) > node[n].top_zone)
+            node[n].top_zone = zone_index(pfn);
+
+        pfn += order_pages(k);
+    }
+}
+
 int init_free_physical_memory(void)
 {
+    /*
+     * Builds the free lists from the memory map, a range at a time. Pages
+     * are not touched, so the cost does not grow with the amount of RAM,
+     * apart from clearing the page descriptor array.
+     */
     uint32_t i, num_entries;
     struct pa_range_descriptor *p;
+    struct zone *z;
+    uint32_t n;
+    uint64_t s, e;
+
+    if (init_page_descriptors())
+        return -1;
 
     num_entries = *(uint32_t *) MEMORY_MAP_ENTRY_COUNT_VA;
     p = (struct pa_range_descriptor *) MEMORY_MAP_VA;
 
     for (i = 0; i < num_entries; ++i) {
-        if (p->type == MEMORY_TYPE_USABLE)
-            free_range_va(pa_to_va(p->pa), p->size);
+        if (!find_usable_page_range_pa(p, &s, &e)) {
+            /* Skip the pages holding the page descriptors. */
+            if (s < page_desc_end_pa_excl && e > page_desc_start_pa) {
+                if (s < page_desc_start_pa)
+                    free_range_pa(s, page_desc_start_pa);
+
+                if (e > page_desc_end_pa_excl)
+                    free_range_pa(page_desc_end_pa_excl, e);
+            } else {
+                free_range_pa(s, e);
+            }
+        }
 
         ++p;
     }
 
+    for (n = 0; n < num_nodes; ++n)
+        for (z = node[n].zone; z < node[n].zone + NUM_ZONES; ++z)
+            if (z->reserve_divisor)
+                z->watermark = z->num_pages / z->reserve_divisor;
+
     if (report_physical_memory())
         return -1;
 
@@ -28,11 +28,44 @@
 
 #include "stdint.h"
 
+/* Physical memory map entry types. */
+#define MEMORY_TYPE_USABLE   1
+#define MEMORY_TYPE_RESERVED 2
+#define MEMORY_TYPE_ACPI     3
+#define MEMORY_TYPE_ACPI_NVS 4
+
+/* Allocation flags. */
+/* The caller overwrites the whole block, so skip clearing. */
+#define ALLOC_NO_ZERO 1
+/* Only use memory below 16 MiB. */
+#define ALLOC_DMA (1 << 1)
+/* Only use memory below 4 GiB. */
+#define ALLOC_DMA32 (1 << 2)
+/* Prefer memory from a NUMA node, rather than from the node of the CPU. */
+#define ALLOC_NODE_SHIFT 8
+#define ALLOC_NODE_MASK  (0xFF << ALLOC_NODE_SHIFT)
+#define ALLOC_NODE(n)    (((n) + 1) << ALLOC_NODE_SHIFT)
+
+/* Physical memory map entry, as saved by the loader.asm file. */
+struct pa_range_descriptor {
+    uint64_t pa;
+    uint64_t size;
+    uint32_t type;
+} __attribute__((packed));
+
 int print_memory_map_pa(void);
+void free_pages_pa(uint64_t start_pa, uint32_t order);
+uint64_t allocate_pages_pa(uint32_t order, uint32_t flags);
 void free_page_pa(uint64_t start_page_pa);
 uint64_t allocate_page_pa(void);
+uint64_t allocate_frame_pa(uint32_t flags);
+void free_frame_pa(uint64_t frame_pa);
+int share_pa(uint64_t pa);
+uint32_t count_references_pa(uint64_t pa);
+int refill_zero_pool(void);
 int init_free_physical_memory(void);
 int report_physical_memory(void);
+uint64_t count_free_physical_memory(void);
 int check_physical_memory(void);
 
 #endif
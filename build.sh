@@ -46,7 +46,9 @@ cc=clang
 ld=ld.lld
 # ld=ld
 
-cc_op='-DTOUCANIX -DDEBUG -DDEBUG_SCAN_CODES=0'
+# BOOT_CHECKS=1 runs the memory leak checks before the first process starts.
+# BENCHMARKS=1 runs and prints the kernel benchmarks at boot.
+cc_op='-DTOUCANIX -DDEBUG -DDEBUG_SCAN_CODES=0 -DBOOT_CHECKS=0 -DBENCHMARKS=0'
 
 if [ "$cc" = clang ]
 then
@@ -170,6 +172,7 @@ get_var KERNEL_SECTORS
 get_var USER_A_SECTORS
 get_var USER_B_SECTORS
 get_var USER_C_SECTORS
+get_var USER_LIB_SECTORS
 
 get_var BYTES_PER_SECTOR
 
@@ -179,6 +182,9 @@ get_var KERNEL_START_SECTOR
 get_var USER_A_START_SECTOR
 get_var USER_B_START_SECTOR
 get_var USER_C_START_SECTOR
+get_var USER_LIB_START_SECTOR
+
+get_var USER_LIB_VA
 
 
 # Generate files.
@@ -220,6 +226,13 @@ sed -E \
     linker_script.ld > user_lib/u_linker_script.ld
 
 
+# The shared user library is linked at its own fixed address.
+sed -E \
+    -e "s~^(IMAGE_START_VA = ).*;\$~\1$USER_LIB_VA;~" \
+    -e 's~^ENTRY\(_start\)$~~' \
+    user_lib/u_linker_script.ld > user_lib/u_lib_linker_script.ld
+
+
 # Fix permissions.
 find . -type d ! -path '*.git/*'                -exec chmod 700 '{}' \;
 find . -type f ! -path '*.git/*' ! -name '*.sh' -exec chmod 600 '{}' \;
@@ -284,6 +297,7 @@ dd if=/dev/zero of=boot.img bs="$BYTES_PER_SECTOR" \
 "$asm" -f elf64 -o interrupt_a.o interrupt.asm
 "$asm" -f elf64 -o asm_lib_a.o asm_lib.asm
 "$asm" -f elf64 -o paging_a.o paging.asm
+"$asm" -f elf64 -o acpi_a.o acpi.asm
 
 cd user_lib || exit 1
 "$asm" -f elf64 -o u_system_call_a.o u_system_call.asm
@@ -320,8 +334,13 @@ cc_c kernel.c
 cc_c interrupt.c
 cc_c k_printf.c
 cc_c screen.c
+cc_c acpi.c
 cc_c allocator.c
+cc_c slab.c
+cc_c vmalloc.c
 cc_c paging.c
+cc_c vma.c
+cc_c compress.c
 cc_c process.c
 cc_c system_call.c
 cc_c ll.c
@@ -333,30 +352,34 @@ cc_c user_app_b/hello_world.c
 cc_c user_app_c/hello_world.c
 
 
-# Create user lib archive.
-ar rsc user_lib/user_lib.a user_lib/u_system_call_a.o user_lib/printf_c.o
+# Shared user library. It is mapped at a fixed address into every process,
+# and the executables are linked against its symbols.
+"$ld" $ld_op -T user_lib/u_lib_linker_script.ld -o user_lib/user_lib \
+    user_lib/u_system_call_a.o user_lib/printf_c.o
 
 
 "$ld" $ld_op -T linker_script.ld -o kernel \
     kernel_a.o kernel_c.o interrupt_a.o interrupt_c.o asm_lib_a.o \
-    k_printf_c.o screen_c.o allocator_c.o paging_a.o paging_c.o process_c.o \
+    k_printf_c.o screen_c.o acpi_a.o acpi_c.o allocator_c.o slab_c.o \
+    vmalloc_c.o paging_a.o paging_c.o vma_c.o compress_c.o process_c.o \
     system_call_c.o ll.o circular_buffer.o keyboard.o
 
 
 "$ld" $ld_op -T user_lib/u_linker_script.ld -o user_app_a/user_a \
-    user_app_a/init_c.o user_lib/_start_a.o user_lib/user_lib.a
+    user_app_a/init_c.o user_lib/_start_a.o -R user_lib/user_lib
 
 "$ld" $ld_op -T user_lib/u_linker_script.ld -o user_app_b/user_b \
-    user_app_b/hello_world_c.o user_lib/_start_a.o user_lib/user_lib.a
+    user_app_b/hello_world_c.o user_lib/_start_a.o -R user_lib/user_lib
 
 "$ld" $ld_op -T user_lib/u_linker_script.ld -o user_app_c/user_c \
-    user_app_c/hello_world_c.o user_lib/_start_a.o user_lib/user_lib.a
+    user_app_c/hello_world_c.o user_lib/_start_a.o -R user_lib/user_lib
 
 
 objcopy -O binary kernel kernel.bin
 objcopy -O binary user_app_a/user_a user_app_a/user_a.bin
 objcopy -O binary user_app_b/user_b user_app_b/user_b.bin
 objcopy -O binary user_app_c/user_c user_app_c/user_c.bin
+objcopy -O binary user_lib/user_lib user_lib/user_lib.bin
 
 
 check_size mbr.bin "$MBR_SECTOR"
@@ -386,10 +409,23 @@ check_size user_app_c/user_c.bin "$USER_C_SECTORS"
 dd if=user_app_c/user_c.bin of=boot.img bs="$BYTES_PER_SECTOR" \
     seek="$USER_C_START_SECTOR" conv=notrunc
 
+check_size user_lib/user_lib.bin "$USER_LIB_SECTORS"
+dd if=user_lib/user_lib.bin of=boot.img bs="$BYTES_PER_SECTOR" \
+    seek="$USER_LIB_START_SECTOR" conv=notrunc
+
 
 qemu-system-x86_64 -display curses -cpu kvm64,pdpe1gb -m 1024 \
     -drive file=boot.img,index=0,media=disk,format=raw
 
+# Two NUMA nodes, with the boot CPU in node 1 and a SLIT distance:
+# qemu-system-x86_64 -display curses -cpu kvm64,pdpe1gb -m 2048 -smp 2 \
+#     -object memory-backend-ram,id=m0,size=1024M \
+#     -object memory-backend-ram,id=m1,size=1024M \
+#     -numa node,nodeid=0,cpus=1,memdev=m0 \
+#     -numa node,nodeid=1,cpus=0,memdev=m1 \
+#     -numa dist,src=0,dst=1,val=21 \
+#     -drive file=boot.img,index=0,media=disk,format=raw
+
 
 # Build test code.
 cc -c -DDEBUG -ansi -Wall -Wextra -pedantic ll.c
@@ -400,4 +436,20 @@ cc -c -DDEBUG -ansi -Wall -Wextra -pedantic circular_buffer.c
 cc -c -DDEBUG -ansi -Wall -Wextra -pedantic test/test_circular_buffer.c
 cc test_circular_buffer.o circular_buffer.o -o test/test_circular_buffer
 
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic allocator.c
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic test/test_allocator.c
+cc test_allocator.o allocator.o -pthread -o test/test_allocator
+
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic vma.c
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic test/test_vma.c
+cc test_vma.o vma.o -o test/test_vma
+
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic compress.c
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic test/test_compress.c
+cc test_compress.o compress.o -o test/test_compress
+
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic slab.c
+cc -c -DDEBUG -ansi -Wall -Wextra -pedantic test/test_slab.c
+cc test_slab.o slab.o -o test/test_slab
+
 clean_up
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * LZ77 compression in the LZ4 block format, for compressing frames of
+ * memory.
+ *
+ * The output is a series of sequences. Each starts with a token byte, whose
+ * upper nibble is the number of literals that follow it, and whose lower
+ * nibble is the match length minus MIN_MATCH. A nibble of 15 is extended by
+ * the bytes that follow, each added on, up to the first that is not 255.
+ * The literals come next, then a two byte little-endian offset back to the
+ * match, then the extension of the match length. The last sequence has only
+ * literals, and ends the input.
+ *
+ * Matches are found through a table of the last position of each hash of
+ * four bytes, so compression makes a single pass.
+ */
+
+#include "compress.h"
+
+#define MIN_MATCH 4
+
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+
+#define NIBBLE_MAX 15
+#define BYTE_MAX   255
+
+#define MAX_OFFSET 0xFFFF
+
+/* Knuth's multiplicative hash. */
+#define hash32(v) ((uint32_t) ((v) * 2654435761U) >> (32 - HASH_BITS))
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+        | (uint32_t) p[3] << 24;
+}
+
+static int put_length(
+    unsigned char *dst, uint32_t *o, uint32_t capacity, uint32_t n)
+{
+    /* Writes the extension of a nibble that is NIBBLE_MAX. */
+    for (n -= NIBBLE_MAX; n >= BYTE_MAX; n -= BYTE_MAX) {
+        if (*o == capacity)
+            return -1;
+
+        dst[(*o)++] = BYTE_MAX;
+    }
+
+    if (*o == capacity)
+        return -1;
+
+    dst[(*o)++] = (unsigned char) n;
+
+    return 0;
+}
+
+static int put_sequence(unsigned char *dst, uint32_t *o, uint32_t capacity,
+    const unsigned char *literals, uint32_t num_literals, uint32_t offset,
+    uint32_t match_length)
+{
+    /* Writes a sequence. A match length of zero ends the output. */
+    uint32_t m, k;
+
+    m = match_length ? match_length - MIN_MATCH : 0;
+
+    if (*o == capacity)
+        return -1;
+
+    dst[(*o)++] = (unsigned char) ((num_literals < NIBBLE_MAX ? num_literals
+                                                             : NIBBLE_MAX)
+            << 4
+        | (m < NIBBLE_MAX ? m : NIBBLE_MAX));
+
+    if (num_literals >= NIBBLE_MAX
+        && put_length(dst, o, capacity, num_literals))
+        return -1;
+
+    if (capacity - *o < num_literals)
+        return -1;
+
+    for (k = 0; k < num_literals; ++k) dst[(*o)++] = literals[k];
+
+    if (!match_length)
+        return 0;
+
+    if (capacity - *o < 2)
+        return -1;
+
+    dst[(*o)++] = (unsigned char) offset;
+    dst[(*o)++] = (unsigned char) (offset >> 8);
+
+    if (m >= NIBBLE_MAX && put_length(dst, o, capacity, m))
+        return -1;
+
+    return 0;
+}
+
+uint32_t compress_lz(const unsigned char *src, uint32_t size,
+    unsigned char *dst, uint32_t capacity)
+{
+    /*
+     * Compresses size bytes, of at most LZ_MAX_INPUT. Returns the size of
+     * the output, or 0 if it does not fit in the capacity.
+     */
+    uint16_t table[HASH_SIZE]; /* Position plus one, or zero for none. */
+    uint32_t i, anchor, o, h, m, len;
+
+    if (size > LZ_MAX_INPUT)
+        return 0;
+
+    for (i = 0; i < HASH_SIZE; ++i) table[i] = 0;
+
+    i = 0;
+    anchor = 0;
+    o = 0;
+
+    while (size - i >= MIN_MATCH) {
+        h = hash32(read32(src + i));
+        m = table[h];
+        table[h] = (uint16_t) (i + 1);
+
+        if (!m || i - (m - 1) > MAX_OFFSET
+            || read32(src + m - 1) != read32(src + i)) {
+            ++i;
+            continue;
+        }
+
+        --m;
+        for (len = MIN_MATCH; i + len < size && src[m + len] == src[i + len];
+            ++len);
+
+        if (put_sequence(
+                dst, &o, capacity, src + anchor, i - anchor, i - m, len))
+            return 0;
+
+        i += len;
+        anchor = i;
+    }
+
+    if (put_sequence(dst, &o, capacity, src + anchor, size - anchor, 0, 0))
+        return 0;
+
+    return o;
+}
+
+static int get_length(
+    const unsigned char *src, uint32_t size, uint32_t *i, uint32_t *n)
+{
+    /* Adds the extension of a nibble that is NIBBLE_MAX. */
+    unsigned char b;
+
+    do {
+        if (*i == size || *n > LZ_MAX_INPUT)
+            return -1;
+
+        b = src[(*i)++];
+        *n += b;
+    } while (b == BYTE_MAX);
+
+    return 0;
+}
+
+int64_t decompress_lz(const unsigned char *src, uint32_t size,
+    unsigned char *dst, uint32_t capacity)
+{
+    /*
+     * Decompresses size bytes. Returns the size of the output, or -1 if the
+     * input is malformed, or if the output does not fit in the capacity.
+     */
+    uint32_t i = 0, o = 0, n, offset, k;
+    unsigned char token;
+
+    while (i < size) {
+        token = src[i++];
+
+        n = token >> 4;
+        if (n == NIBBLE_MAX && get_length(src, size, &i, &n))
+            return -1;
+
+        if (size - i < n || capacity - o < n)
+            return -1;
+
+        for (k = 0; k < n; ++k) dst[o++] = src[i++];
+
+        if (i == size)
+            break;
+
+        if (size - i < 2)
+            return -1;
+
+        offset = (uint32_t) src[i] | (uint32_t) src[i + 1] << 8;
+        i += 2;
+
+        if (offset == 0 || offset > o)
+            return -1;
+
+        n = (token & NIBBLE_MAX) + MIN_MATCH;
+        if ((token & NIBBLE_MAX) == NIBBLE_MAX
+            && get_length(src, size, &i, &n))
+            return -1;
+
+        if (capacity - o < n)
+            return -1;
+
+        /* The match can overlap the output, so it is copied forwards. */
+        for (k = 0; k < n; ++k, ++o) dst[o] = dst[o - offset];
+    }
+
+    return (int64_t) o;
+}
@@ -42,26 +42,36 @@ extern int dummy;
 /* Disk image sectors. */
 #define MBR_SECTOR     1
 #define PRINT_SECTORS  1
-#define LOADER_SECTORS 2
-#define KERNEL_SECTORS 120
-#define USER_A_SECTORS 6
-#define USER_B_SECTORS 6
-#define USER_C_SECTORS 6
+#define LOADER_SECTORS 3
+#define KERNEL_SECTORS 248
+/* Room for a frame of read-only text and rodata, then a frame of data. */
+#define USER_A_SECTORS 16
+#define USER_B_SECTORS 16
+#define USER_C_SECTORS 16
+/* The shared user library. */
+#define USER_LIB_SECTORS 16
 
 #define BYTES_PER_SECTOR 512
 
 /* Disk starting sectors. */
-#define PRINT_START_SECTOR  MBR_SECTOR
-#define LOADER_START_SECTOR (PRINT_START_SECTOR + PRINT_SECTORS)
-#define KERNEL_START_SECTOR (LOADER_START_SECTOR + LOADER_SECTORS)
-#define USER_A_START_SECTOR (KERNEL_START_SECTOR + KERNEL_SECTORS)
-#define USER_B_START_SECTOR (USER_A_START_SECTOR + USER_A_SECTORS)
-#define USER_C_START_SECTOR (USER_B_START_SECTOR + USER_B_SECTORS)
+#define PRINT_START_SECTOR    MBR_SECTOR
+#define LOADER_START_SECTOR   (PRINT_START_SECTOR + PRINT_SECTORS)
+#define KERNEL_START_SECTOR   (LOADER_START_SECTOR + LOADER_SECTORS)
+#define USER_A_START_SECTOR   (KERNEL_START_SECTOR + KERNEL_SECTORS)
+#define USER_B_START_SECTOR   (USER_A_START_SECTOR + USER_A_SECTORS)
+#define USER_C_START_SECTOR   (USER_B_START_SECTOR + USER_B_SECTORS)
+#define USER_LIB_START_SECTOR (USER_C_START_SECTOR + USER_C_SECTORS)
 
 #define KERNEL_SIZE (KERNEL_SECTORS * BYTES_PER_SECTOR)
+/* The kernel is read in two parts, as a BIOS read is limited to 127 */
+/* sectors. */
+#define KERNEL_PART_SECTORS (KERNEL_SECTORS / 2)
+#define KERNEL_PART_SIZE    (KERNEL_PART_SECTORS * BYTES_PER_SECTOR)
+#define KERNEL_PART_2_START_SECTOR (KERNEL_START_SECTOR + KERNEL_PART_SECTORS)
 #define USER_A_SIZE (USER_A_SECTORS * BYTES_PER_SECTOR)
 #define USER_B_SIZE (USER_B_SECTORS * BYTES_PER_SECTOR)
 #define USER_C_SIZE (USER_C_SECTORS * BYTES_PER_SECTOR)
+#define USER_LIB_SIZE (USER_LIB_SECTORS * BYTES_PER_SECTOR)
 
 #define DWORD_SIZE                 4
 #define PAGE_TABLE_SIZE            0x1000
@@ -71,6 +81,11 @@ extern int dummy;
 #define MAX_MAPPED_VA_EXCL                                                    \
     (KERNEL_SPACE_VA + ((uint64_t) NUM_GIB_MAPPED << EXP_1_GIB))
 
+/* Kernel virtual allocations (vmalloc) are mapped in the PML4 entry after */
+/* the mapped memory, in up to VMALLOC_PAGES pages. */
+#define VMALLOC_START_VA MAX_MAPPED_VA_EXCL
+#define VMALLOC_PAGES    32768
+
 /* Physcial addresses. */
 #define MBR_PA                    0x7c00
 #define PRINT_PA                  (MBR_PA + MBR_SECTOR * BYTES_PER_SECTOR)
@@ -81,9 +96,11 @@ extern int dummy;
 #define MEMORY_MAP_ENTRY_COUNT_PA 0x9000
 #define MEMORY_MAP_PA             (MEMORY_MAP_ENTRY_COUNT_PA + DWORD_SIZE)
 #define KERNEL_ORIGINAL_PA        0x10000
-#define USER_A_PA                 0x20000
-#define USER_B_PA                 0x30000
-#define USER_C_PA                 0x40000
+#define KERNEL_PART_2_PA          (KERNEL_ORIGINAL_PA + KERNEL_PART_SIZE)
+#define USER_A_PA                 0x30000
+#define USER_B_PA                 0x40000
+#define USER_C_PA                 0x50000
+#define USER_LIB_PA               0x60000
 #define PML4_PA                   0x70000
 #define PDPT_PA                   (PML4_PA + PAGE_TABLE_SIZE)
 #define VIDEO_PA                  0xb8000
@@ -95,6 +112,9 @@ extern int dummy;
 #define KERNEL_ORIGINAL_SEGMENT (KERNEL_ORIGINAL_PA / 16)
 #define KERNEL_ORIGINAL_OFFSET  (KERNEL_ORIGINAL_PA % 16)
 
+#define KERNEL_PART_2_SEGMENT (KERNEL_PART_2_PA / 16)
+#define KERNEL_PART_2_OFFSET  (KERNEL_PART_2_PA % 16)
+
 #define USER_A_SEGMENT (USER_A_PA / 16)
 #define USER_A_OFFSET  (USER_A_PA % 16)
 
@@ -104,11 +124,22 @@ extern int dummy;
 #define USER_C_SEGMENT (USER_C_PA / 16)
 #define USER_C_OFFSET  (USER_C_PA % 16)
 
+#define USER_LIB_SEGMENT (USER_LIB_PA / 16)
+#define USER_LIB_OFFSET  (USER_LIB_PA % 16)
+
 /* Virtual addresses. */
+/* The shared user library is mapped below the executable. */
+#define USER_LIB_VA          0x200000
 #define USER_EXEC_START_VA   0x400000
 #define NON_CANONICAL_MIN_VA 0x0000800000000000
 /* push decrements the stack before storing. */
-#define USER_STACK_VA NON_CANONICAL_MIN_VA
+#define USER_STACK_VA   NON_CANONICAL_MIN_VA
+/* The user stack grows down on demand, up to a per-process limit. The */
+/* guard gap below the limit is never mapped. */
+#define USER_STACK_LIMIT      0x800000
+#define USER_STACK_GUARD_SIZE 0x200000
+/* Anonymous memory is mapped from here up to the stack guard gap. */
+#define USER_MMAP_VA 0x40000000
 /* Start of the higher 48-bit canonical address region. */
 #define KERNEL_SPACE_VA           0xffff800000000000
 #define PRINT_VA                  (KERNEL_SPACE_VA + PRINT_PA)
@@ -119,16 +150,26 @@ extern int dummy;
 #define KERNEL_VA                 (KERNEL_SPACE_VA + KERNEL_PA)
 #define KERNEL_STACK_VA           KERNEL_VA
 
+#define EXP_4_KIB 12
 #define EXP_2_MIB 21
 #define EXP_1_GIB 30
 
 #define PAGE_SIZE (1 << EXP_2_MIB)
 
+/* Small pages, carved out of a page. Also the size of a paging structure. */
+#define FRAME_SIZE      (1 << EXP_4_KIB)
+#define FRAMES_PER_PAGE (PAGE_SIZE / FRAME_SIZE)
+
+/* Buddy allocator. The largest block is PAGE_SIZE << (PAGE_ORDERS - 1). */
+#define PAGE_ORDERS 11
+
 #define PAGE_PRESENT   1
 #define READ_AND_WRITE (1 << 1)
 #define USER_ACCESS    (1 << 2)
 /* Page Size attribute. */
 #define PS (1 << 7)
+/* Global page: Kept in the TLB across CR3 writes. Leaf entries only. */
+#define GLOBAL_PAGE (1 << 8)
 
 /* Newline character. */
 #define NL 10
@@ -191,6 +232,7 @@ extern int dummy;
 #define U64_MAX_HEX_DIGITS 18
 #define U64_MAX            0xFFFFFFFFFFFFFFFF
 #define U32_MAX            0xFFFFFFFF
+#define U16_MAX            0xFFFF
 #define U8_MAX             0xFF
 #define ASCII_MAX          0x7F
 
@@ -203,10 +245,41 @@ extern int dummy;
 #define SOFTWARE_INT 0x80
 
 /* Software system call numbers. */
-#define SYS_CALL_WRITE    0
-#define SYS_CALL_SLEEP    1
-#define SYS_CALL_EXIT     2
-#define SYS_CALL_CLEAN_UP 3
+#define SYS_CALL_WRITE        0
+#define SYS_CALL_SLEEP        1
+#define SYS_CALL_EXIT         2
+#define SYS_CALL_CLEAN_UP     3
+#define SYS_CALL_FORK         4
+#define SYS_CALL_MMAP         5
+#define SYS_CALL_MUNMAP       6
+#define SYS_CALL_MADVISE      7
+#define SYS_CALL_WORKING_SET  8
+#define SYS_CALL_MEMORY_STAT  9
+#define SYS_CALL_MEMORY_LIMIT 10
+
+/* Memory mapping flag: back the mapping with 2 MiB pages. */
+#define MAP_HUGE 1
+
+/* Memory advice: free the memory. It reads back as zero. */
+#define MADV_DONTNEED 4
+
+/* Working-set figures, in frames, from the last sample of a process. */
+#define WS_HOT   0
+#define WS_COLD  1
+#define WS_DIRTY 2
+/* Timer count when the last working-set sample of a process was taken. */
+#define WS_TICK 3
+
+/* Memory figures of a process, in frames. */
+#define MEM_DATA   0
+#define MEM_TABLES 1
+#define MEM_KERNEL 2
+#define MEM_TOTAL  3
+#define MEM_LIMIT  4
+/* Added to a figure for its high-water mark, or for the process group. */
+/* Kernel stacks are not charged to the group, so its MEM_KERNEL stays zero. */
+#define MEM_PEAK  8
+#define MEM_GROUP 16
 
 /* Timer. */
 #define EVENTS_PER_SECOND 100
@@ -227,9 +300,22 @@ extern int dummy;
 /* Processes. */
 #define MAX_PROCESSES 1024
 
+/* Default memory limits, which are also the highest that can be set. */
+#define PROCESS_MEMORY_LIMIT 0x4000000
+#define GROUP_MEMORY_LIMIT   0x10000000
+
 /* [Doubly] Linked List. */
 #define MAX_NODES MAX_PROCESSES
 
+/* Virtual memory areas per user space. */
+#define MAX_VMAS 16
+
+/* CPUs that the physical memory allocator keeps page caches for. */
+#define MAX_CPUS 8
+
+/* NUMA nodes that physical memory can be spread over. */
+#define MAX_NUMA_NODES 8
+
 /* Circular buffer for keyboard. */
 #define CIRCULAR_BUFFER_SIZE 512
 
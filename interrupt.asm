@@ -50,6 +50,7 @@ global enter_process
 global get_cr2
 global switch_process
 global read_byte
+global wait_for_interrupt
 
 
 %macro push_all 0
@@ -256,3 +257,15 @@ read_byte:
 mov rdx, rdi
 in al, dx
 ret
+
+
+
+
+wait_for_interrupt:
+; Enables interrupts and halts until the next one has been handled.
+; sti only takes effect after the next instruction, so an interrupt cannot
+; arrive between the two and leave the hlt waiting.
+sti
+hlt
+cli
+ret
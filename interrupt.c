@@ -181,6 +181,7 @@ void interrupt_handler(uint64_t address_of_interrupt_stack_frame)
          */
         ++timer_counter;
         wake_up(TIMER_SLEEP);
+        sample_working_sets();
         give_up_execution();
         break;
     case 33:
@@ -204,6 +205,12 @@ void interrupt_handler(uint64_t address_of_interrupt_stack_frame)
         system_call(isf_va);
         break;
 
+    case 14:
+        /* Page fault. Anything that cannot be resolved is reported below. */
+        if (!page_fault(get_cr2(), isf_va->error_code))
+            break;
+
+        /* Fall through. */
     default:
         v = (char *) VIDEO_VA + 4;
         switch (isf_va->vector_number) {
@@ -59,5 +59,6 @@ void init_idt(void);
 void enter_process(struct interrupt_stack_frame *isf_va);
 void switch_process(uint64_t *exiting_rsp_save, uint64_t entering_rsp_save);
 unsigned char read_byte(unsigned char port_address);
+void wait_for_interrupt(void);
 
 #endif
@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 
+#include "acpi.h"
 #include "address.h"
 #include "allocator.h"
 #include "asm_lib.h"
@@ -32,17 +33,32 @@
 #include "paging.h"
 #include "process.h"
 #include "screen.h"
+#include "slab.h"
 #include "stop.h"
+#include "vmalloc.h"
+
+#if BOOT_CHECKS
+/* Number of user spaces created and freed by the boot-time leak check. */
+#define TEARDOWN_CHECK_CYCLES 10000
+
+/* Size, in pages, of the boot-time kernel virtual allocation check. */
+#define VMALLOC_CHECK_PAGES 8
+#endif
 
 extern char etext, edata, end;
 
 void kernel_main(void)
 {
     uint64_t pml4_pa;
+#if BENCHMARKS
+    uint64_t start;
+#endif
 
     init_idt();
     init_screen();
 
+    stop(init_acpi());
+
     (void) k_printf("Physical memory map:\n");
     stop(print_memory_map_pa());
 
@@ -50,10 +66,19 @@ void kernel_main(void)
     (void) k_printf("edata: %lx\n", (unsigned long) &edata);
     (void) k_printf("end: %lx\n", (unsigned long) &end);
 
+#if BENCHMARKS
+    start = read_time_stamp_counter();
+#endif
     stop(init_free_physical_memory());
+#if BENCHMARKS
+    (void) k_printf("Physical memory initialised in %lu cycles\n",
+        (unsigned long) (read_time_stamp_counter() - start));
+#endif
 
     stop(check_physical_memory());
 
+    stop(init_kmalloc());
+
     stop(!(pml4_pa = create_kernel_virtual_memory_space()));
 
     stop(report_physical_memory());
@@ -62,6 +87,25 @@ void kernel_main(void)
 
     switch_pml4_pa(pml4_pa);
 
+    init_tlb();
+
+#if BENCHMARKS
+    stop(benchmark_address_space_switch());
+#endif
+
+#if BOOT_CHECKS
+    stop(check_address_space_teardown(TEARDOWN_CHECK_CYCLES));
+
+    stop(check_vmalloc(VMALLOC_CHECK_PAGES));
+#endif
+
+    stop(report_physical_memory());
+
+    stop(report_slab_caches());
+
+    /* Nothing else is running yet, so fill the pool of cleared pages. */
+    while (refill_zero_pool());
+
     (void) k_printf("Initialise process...\n");
 
     stop(start_init_process());
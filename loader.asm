@@ -80,6 +80,8 @@ MSR_EFER equ 0xC0000080
 LONG_MODE_ENABLE equ 1 << 8
 PA_EXTENSION equ 1 << 5
 PAGING equ 1 << 31
+; Read-only pages are also enforced on the kernel.
+WRITE_PROTECT equ 1 << 16
 
 
 ; PML4 = Page Map Level 4 (table).
@@ -137,6 +139,14 @@ mov ah, EXTENDED_READ_FUNCTION_CODE
 int BIOS_DISK_SERVICES
 jc error_e
 
+mov dl, DISK
+xor ax, ax
+mov ds, ax
+mov si, kernel_part_2_disk_address_packet
+mov ah, EXTENDED_READ_FUNCTION_CODE
+int BIOS_DISK_SERVICES
+jc error_e
+
 
 ; Load user A bin.
 mov dl, DISK
@@ -168,6 +178,16 @@ int BIOS_DISK_SERVICES
 jc error_h
 
 
+; Load the shared user library.
+mov dl, DISK
+xor ax, ax
+mov ds, ax
+mov si, user_lib_disk_address_packet
+mov ah, EXTENDED_READ_FUNCTION_CODE
+int BIOS_DISK_SERVICES
+jc error_i
+
+
 kernel_loaded:
 
 ; Prepare for Protected Mode.
@@ -207,6 +227,9 @@ error_g:
 error_h:
     mov si, user_c_load_failed
     jmp error
+error_i:
+    mov si, user_lib_load_failed
+    jmp error
 
 error:
 xor ax, ax
@@ -277,7 +300,7 @@ or eax, PA_EXTENSION
 mov cr4, eax
 
 mov eax, cr0
-or eax, PAGING
+or eax, PAGING | WRITE_PROTECT
 mov cr0, eax
 
 jmp CODE_SELECTOR:long_mode_start
@@ -328,16 +351,24 @@ kernel_load_failed: db 'ERROR: Failed to load kernel', NL, 0
 user_a_load_failed: db 'ERROR: Failed to load user A', NL, 0
 user_b_load_failed: db 'ERROR: Failed to load user B', NL, 0
 user_c_load_failed: db 'ERROR: Failed to load user C', NL, 0
+user_lib_load_failed: db 'ERROR: Failed to load user lib', NL, 0
 
 
-; For reading kernel into memory.
+; For reading kernel into memory, in two parts.
 kernel_disk_address_packet:
 db DISK_PA_PACKET_SIZE
 db 0
-dw KERNEL_SECTORS
+dw KERNEL_PART_SECTORS
 dw KERNEL_ORIGINAL_OFFSET, KERNEL_ORIGINAL_SEGMENT
 dq KERNEL_START_SECTOR
 
+kernel_part_2_disk_address_packet:
+db DISK_PA_PACKET_SIZE
+db 0
+dw KERNEL_PART_SECTORS
+dw KERNEL_PART_2_OFFSET, KERNEL_PART_2_SEGMENT
+dq KERNEL_PART_2_START_SECTOR
+
 
 ; For reading user A bin into memory.
 user_a_disk_address_packet:
@@ -363,6 +394,14 @@ dw USER_C_SECTORS
 dw USER_C_OFFSET, USER_C_SEGMENT
 dq USER_C_START_SECTOR
 
+; For reading the shared user library into memory.
+user_lib_disk_address_packet:
+db DISK_PA_PACKET_SIZE
+db 0
+dw USER_LIB_SECTORS
+dw USER_LIB_OFFSET, USER_LIB_SEGMENT
+dq USER_LIB_START_SECTOR
+
 
 
 
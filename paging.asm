@@ -24,11 +24,70 @@
 ;
 
 
+; cpuid.
+GET_FEATURES equ 1
+PGE_SUPPORT  equ 1 << 13 ; edx.
+PCID_SUPPORT equ 1 << 17 ; ecx.
+
+CR4_PGE   equ 1 << 7
+CR4_PCIDE equ 1 << 17
+
+
 section .text
 global switch_pml4_pa
+global enable_tlb_features
+global read_time_stamp_counter
+global invalidate_page
 
 
 switch_pml4_pa:
 ; Argument 1: rdi: Physical address of the start of the new PML4.
+; The lower 12 bits hold the PCID, and bit 63 skips the flush of its
+; TLB entries, when PCIDs are enabled.
 mov cr3, rdi
 ret
+
+
+
+
+enable_tlb_features:
+; Enables global pages and PCIDs, when supported.
+; PCIDs can only be enabled while the PCID in cr3 is zero.
+; Returns: rax: 1 if PCIDs were enabled, otherwise 0.
+push rbx ; Used by cpuid.
+mov eax, GET_FEATURES
+cpuid
+mov rax, cr4
+xor r8, r8
+test edx, PGE_SUPPORT
+jz .no_pge
+or rax, CR4_PGE
+.no_pge:
+test ecx, PCID_SUPPORT
+jz .no_pcid
+or rax, CR4_PCIDE
+mov r8, 1
+.no_pcid:
+mov cr4, rax
+mov rax, r8
+pop rbx
+ret
+
+
+
+
+read_time_stamp_counter:
+; Returns: rax: The time-stamp counter.
+rdtsc
+shl rdx, 32
+or rax, rdx
+ret
+
+
+
+
+invalidate_page:
+; Argument 1: rdi: Virtual address in the page to remove from the TLB.
+; Global entries are removed too.
+invlpg [rdi]
+ret
@@ -24,9 +24,11 @@
  */
 
 #include "paging.h"
+#include "acpi.h"
 #include "address.h"
 #include "allocator.h"
 #include "asm_lib.h"
+#include "compress.h"
 #include "defs.h"
 #include "k_printf.h"
 
@@ -34,250 +36,2148 @@
 #define pml4_component_va(v)    ((v) >> 39 & 0x1ff)
 #define dir_ptr_component_va(v) ((v) >> 30 & 0x1ff)
 #define dir_component_va(v)     ((v) >> 21 & 0x1ff)
+#define table_component_va(v)   ((v) >> 12 & 0x1ff)
 #define offset_component_va(v)  ((v) & 0x1fffff)
 
+/* Component of a virtual address for a table level, such as TABLE_PD. */
+#define level_component_va(v, level) ((v) >> (39 - 9 * (level)) & 0x1ff)
+
 /* Clears lower n bits. n is evaluated more than once. */
 #define clear_lower_bits(p, n) ((p) >> (n) << (n))
 
-extern uint64_t max_pa_excl;
+/* Aligns up to the next frame if not already aligned. */
+#define align_to_frame(a) (((a) + FRAME_SIZE - 1) >> EXP_4_KIB << EXP_4_KIB)
+
+/* Truncates an address down to the start of its frame. */
+#define truncate_to_frame(a) ((a) >> EXP_4_KIB << EXP_4_KIB)
+
+/* Address of the entry for a virtual address in a table. */
+#define entry_pa(table_pa, component)                                         \
+    ((table_pa) + (component) * BYTES_PER_PAGE_TABLE_ENTRY)
+
+#define USER_PAGE (PAGE_PRESENT | USER_ACCESS)
+
+/*
+ * Marks read-only user data that is shared after a fork, and that becomes
+ * writable again once it is copied. Bit 9 is ignored by the processor.
+ */
+#define COPY_ON_WRITE (1 << 9)
+
+/*
+ * Marks a user entry that is not present because its frame was compressed.
+ * The address bits then hold the address of the compressed copy. Bit 10 is
+ * ignored by the processor.
+ */
+#define SWAPPED (1 << 10)
+
+#define swap_entry(blob_pa)  ((blob_pa) << 12 | SWAPPED)
+#define swap_blob_pa(entry)  ((entry) >> 12)
+#define is_swap_entry(entry) (((entry) & (PAGE_PRESENT | SWAPPED)) == SWAPPED)
+
+/* Frames are only swapped out if they compress to this size or less. */
+#define SWAP_MAX_SIZE (FRAME_SIZE * 3 / 4)
+
+/* Frames that are reclaimed when a user frame cannot be allocated. */
+#define RECLAIM_BATCH 16
+
+/* Accessed flag, set by the processor when an entry is used. */
+#define ACCESSED (1 << 5)
+
+/* Dirty flag, set by the processor when a leaf entry is written through. */
+#define DIRTY (1 << 6)
+
+#define GIB_PAGE_SIZE ((uint64_t) 1 << EXP_1_GIB)
+
+/* Byte offset of the first kernel half entry in a PML4. */
+#define KERNEL_PML4E_OFFSET                                                   \
+    (pml4_component_va(KERNEL_SPACE_VA) * BYTES_PER_PAGE_TABLE_ENTRY)
+
+/* cr3 bit that keeps the TLB entries of the PCID being loaded. */
+#define CR3_NO_FLUSH ((uint64_t) 1 << 63)
+
+/* End of the kernel virtual allocation area. */
+#define VMALLOC_END_VA_EXCL                                                   \
+    (VMALLOC_START_VA + ((uint64_t) VMALLOC_PAGES << EXP_2_MIB))
+
+/* Executable images with a resident copy of their read-only part. */
+#define MAX_RESIDENT_IMAGES 4
+
+/* The boot images are loaded 64 KiB apart. */
+#define MAX_IMAGE_FRAMES 16
+
+/* Amount of user stack that the checks and the benchmark touch. */
+#define CHECK_STACK_SIZE (4 * FRAME_SIZE)
+
+/*
+ * Slots in the table of frames that are candidates for same-page merging.
+ * Must be a power of two.
+ */
+#define MERGE_TABLE_SIZE 1024
+
+/* Slots that are probed for a frame with a given hash. */
+#define MERGE_PROBES 8
+
+/* FNV-1a, applied a quadword at a time. */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+#define FNV_PRIME        0x100000001b3
+
+/* Number of round trips in the address space switch benchmark. */
+#define SWITCH_BENCHMARK_ROUNDS 1000
+
+/*
+ * Table levels, kept in the lower bits of the physical address of each
+ * table in an address space record.
+ */
+#define TABLE_PDPT  1
+#define TABLE_PD    2
+#define TABLE_PT    3
+#define TABLE_LEVEL 3 /* Mask. */
+
+/* Address space record, stored in a frame. */
+#define RECORDS_PER_FRAME                                                     \
+    ((FRAME_SIZE - 2 * sizeof(uint64_t)) / sizeof(uint64_t))
+
+struct record_frame {
+    uint64_t next_pa; /* Older records. */
+    uint64_t count;
+    uint64_t record[RECORDS_PER_FRAME];
+};
+
+/*
+ * A frame of the swap pool. Compressed frames are appended to it, each
+ * after its size, and it is freed once none of them are left.
+ */
+struct pool_frame {
+    uint32_t used; /* Bytes, including this header. */
+    uint32_t live; /* Compressed frames held. */
+};
+
+/*
+ * The read-only part of an executable image, copied once into frames that
+ * every process running it maps. Each mapping holds a reference, and the
+ * copy itself holds one, so that it is kept.
+ */
+struct resident_image {
+    uint64_t source_va;
+    uint64_t num_frames;
+    uint64_t frame_pa[MAX_IMAGE_FRAMES];
+};
+
+/*
+ * A frame seen during a same-page merging pass, and where it is mapped, so
+ * that it can be write-protected if an identical frame turns up.
+ */
+struct merge_candidate {
+    uint64_t hash;
+    uint64_t pa; /* Zero if the slot is free. */
+    struct address_space *as;
+    uint64_t va;
+};
+
+/* Progress of a reclaim walk. */
+struct reclaim_count {
+    uint64_t target;
+    uint64_t freed;
+};
+
+/* The shared kernel space. */
+static struct address_space kernel_space;
+
+/*
+ * A cleared frame that is mapped read-only wherever a user reads memory that
+ * it has not written yet. It is never freed.
+ */
+static uint64_t zero_frame_pa = 0;
+
+static struct resident_image resident_image[MAX_RESIDENT_IMAGES];
+static uint32_t num_resident_images = 0;
+
+static struct merge_candidate merge_table[MERGE_TABLE_SIZE];
+
+/* Same-page merging counts for the current pass, and in total. */
+static uint64_t merge_scanned = 0;
+static uint64_t merge_merged = 0;
+static uint64_t merge_zeroed = 0;
+static uint64_t merge_start = 0;
+static uint64_t merge_total_saved = 0;
+static uint64_t merge_total_cycles = 0;
+
+/* User spaces, newest first. */
+static struct address_space *user_spaces = 0;
+
+/* Swap pool frame that compressed frames are added to. */
+static uint64_t pool_fill_pa = 0;
+
+/* Output of the compressor. */
+static unsigned char swap_buffer[SWAP_MAX_SIZE];
+
+/* Swap counts, in total. */
+static uint64_t swap_outs = 0;
+static uint64_t swap_ins = 0;
+static uint64_t swap_rejects = 0; /* Frames that did not compress enough. */
+static uint64_t swap_packed_bytes = 0;
+static uint64_t swap_out_cycles = 0;
+static uint64_t swap_in_cycles = 0;
+static uint64_t pool_frames = 0;
+
+/* Set when Process-Context Identifiers are in use. */
+static int pcid_enabled = 0;
+
+/* The cr3 value currently loaded, without the no-flush bit. */
+static uint64_t loaded_cr3 = 0;
+
+static int over_limit(const struct memory_account *m, uint64_t frames)
+{
+    return frames > m->limit || m->total > m->limit - frames;
+}
+
+static void add_charge(
+    struct memory_account *m, uint32_t kind, uint64_t frames)
+{
+    m->used[kind] += frames;
+    if (m->used[kind] > m->peak[kind])
+        m->peak[kind] = m->used[kind];
+
+    m->total += frames;
+    if (m->total > m->total_peak)
+        m->total_peak = m->total;
+}
+
+int charge_memory(struct address_space *as, uint32_t kind, uint64_t frames)
+{
+    /*
+     * Charges memory to a user space and to its group, before it is
+     * allocated. Returns -1 if that would go over either limit. Kernel
+     * stacks are only charged to the space, as they would otherwise cap
+     * the number of processes in a group, at 2 MiB each.
+     */
+    int in_group = as->group != 0 && kind != MEM_KERNEL;
+
+    if (over_limit(&as->usage, frames)
+        || (in_group && over_limit(as->group, frames)))
+        return -1;
+
+    add_charge(&as->usage, kind, frames);
+    if (in_group)
+        add_charge(as->group, kind, frames);
+
+    return 0;
+}
+
+static void uncharge_memory(
+    struct address_space *as, uint32_t kind, uint64_t frames)
+{
+    /* Gives back memory that was charged to a user space. */
+    as->usage.used[kind] -= frames;
+    as->usage.total -= frames;
+
+    if (as->group != 0 && kind != MEM_KERNEL) {
+        as->group->used[kind] -= frames;
+        as->group->total -= frames;
+    }
+}
+
+static uint64_t store_blob(
+    const unsigned char *data, uint32_t size, uint64_t *spare_pa)
+{
+    /*
+     * Adds a compressed frame to the swap pool. Returns its address, or 0
+     * on failure. A new pool frame is allocated when the current one is
+     * full. If that fails, the spare frame is used instead, if there is
+     * one, and *spare_pa is cleared. This lets the frame that is being
+     * swapped out hold its own compressed copy when memory has run out.
+     */
+    struct pool_frame *f = 0;
+    uint64_t p, blob_pa;
+    uint32_t need;
+
+    /* Each compressed frame starts on an even byte, after its size. */
+    need = (sizeof(uint16_t) + size + 1) & ~(uint32_t) 1;
+
+    if (pool_fill_pa)
+        f = (struct pool_frame *) pa_to_va(pool_fill_pa);
+
+    if (f == 0 || FRAME_SIZE - f->used < need) {
+        p = allocate_frame_pa(ALLOC_NO_ZERO);
+        if (p == 0) {
+            if ((p = *spare_pa) == 0)
+                return 0;
+
+            *spare_pa = 0;
+        }
+
+        /* The old frame is freed once its last compressed frame is. */
+        if (f != 0 && f->live == 0) {
+            free_frame_pa(pool_fill_pa);
+            --pool_frames;
+        }
+
+        pool_fill_pa = p;
+        ++pool_frames;
+        f = (struct pool_frame *) pa_to_va(p);
+        f->used = sizeof(struct pool_frame);
+        f->live = 0;
+    }
+
+    blob_pa = pool_fill_pa + f->used;
+    *(uint16_t *) pa_to_va(blob_pa) = (uint16_t) size;
+    memcpy((void *) (pa_to_va(blob_pa) + sizeof(uint16_t)), data, size);
+
+    f->used += need;
+    ++f->live;
+
+    return blob_pa;
+}
+
+static void free_blob(uint64_t blob_pa)
+{
+    /* Removes a compressed frame from the swap pool. */
+    struct pool_frame *f;
+
+    f = (struct pool_frame *) pa_to_va(truncate_to_frame(blob_pa));
+    if (--f->live)
+        return;
+
+    if (truncate_to_frame(blob_pa) == pool_fill_pa) {
+        f->used = sizeof(struct pool_frame);
+    } else {
+        free_frame_pa(truncate_to_frame(blob_pa));
+        --pool_frames;
+    }
+}
+
+static void invalidate_user_page(struct address_space *as, uint64_t va)
+{
+    /*
+     * Removes the TLB entry for a user address whose mapping has changed. A
+     * space that is not loaded may still have entries tagged with its PCID,
+     * so it is flushed the next time that it is loaded.
+     */
+    if (clear_lower_bits(loaded_cr3, 12) == as->pml4_pa)
+        invalidate_page(va);
+    else
+        as->tlb_flush_pending = 1;
+}
+
+static int swap_out_frame(
+    struct address_space *as, uint64_t e_va, uint64_t va)
+{
+    /*
+     * Compresses a private frame of user data into the swap pool, and frees
+     * it. The entry keeps the address of the compressed copy. Returns -1 if
+     * the frame does not compress well enough, or if the pool is full.
+     */
+    uint64_t pa, spare_pa, blob_pa, start;
+    uint32_t size;
+
+    pa = clear_lower_bits(*(uint64_t *) e_va, 12);
+
+    start = read_time_stamp_counter();
+    size = compress_lz((const unsigned char *) pa_to_va(pa), FRAME_SIZE,
+        swap_buffer, SWAP_MAX_SIZE);
+    swap_out_cycles += read_time_stamp_counter() - start;
+
+    if (size == 0) {
+        ++swap_rejects;
+        return -1;
+    }
+
+    spare_pa = pa;
+    if ((blob_pa = store_blob(swap_buffer, size, &spare_pa)) == 0)
+        return -1;
+
+    *(uint64_t *) e_va = swap_entry(blob_pa);
+    invalidate_user_page(as, va);
+    uncharge_memory(as, MEM_DATA, 1);
+
+    /* The frame is kept if it became part of the pool. */
+    if (spare_pa)
+        free_frame_pa(pa);
+
+    ++swap_outs;
+    swap_packed_bytes += size;
+
+    return 0;
+}
+
+static int walk_user_table(struct address_space *as, uint64_t table_pa,
+    uint64_t level, uint64_t start_va,
+    int (*fn)(struct address_space *as, uint64_t e_va, uint64_t va,
+        uint64_t level, void *arg),
+    void *arg)
+{
+    /*
+     * Calls fn on each present user mapping under a table, which is a frame
+     * at the PT level, or a page at the PD level, with the virtual address
+     * that it maps. Level zero is the PML4, where only the user half is
+     * walked. Stops and returns 1 as soon as fn returns non-zero.
+     */
+    uint64_t k, end_k, e_va, content, v;
+
+    end_k = level ? PAGE_TABLE_SIZE / BYTES_PER_PAGE_TABLE_ENTRY
+                  : pml4_component_va(KERNEL_SPACE_VA);
+
+    for (k = 0; k < end_k; ++k) {
+        e_va = pa_to_va(entry_pa(table_pa, k));
+        content = *(uint64_t *) e_va;
+        if ((content & USER_PAGE) != USER_PAGE)
+            continue;
+
+        v = start_va + (k << (39 - 9 * level));
+
+        if (level < TABLE_PT && !(content & PS)) {
+            if (walk_user_table(as, clear_lower_bits(content, 12), level + 1,
+                    v, fn, arg))
+                return 1;
+
+            continue;
+        }
+
+        if (fn(as, e_va, v, level, arg))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int walk_user_space(struct address_space *as,
+    int (*fn)(struct address_space *as, uint64_t e_va, uint64_t va,
+        uint64_t level, void *arg),
+    void *arg)
+{
+    return walk_user_table(as, as->pml4_pa, 0, 0, fn, arg);
+}
+
+static int reclaim_entry(struct address_space *as, uint64_t e_va,
+    uint64_t va, uint64_t level, void *arg)
+{
+    /*
+     * Swaps out a private frame of data that has not been accessed since
+     * the last walk or working-set sample, or clears its accessed flag.
+     * Shared and read-only frames, and 2 MiB pages, are left alone. Stops
+     * the walk once the target is met.
+     */
+    struct reclaim_count *c = (struct reclaim_count *) arg;
+    uint64_t content = *(uint64_t *) e_va;
+
+    if (level != TABLE_PT || !(content & READ_AND_WRITE)
+        || count_references_pa(clear_lower_bits(content, 12)) != 1)
+        return 0;
+
+    if (content & ACCESSED) {
+        *(uint64_t *) e_va = content & ~(uint64_t) ACCESSED;
+        invalidate_user_page(as, va);
+    } else if (!swap_out_frame(as, e_va, va)) {
+        ++c->freed;
+    }
+
+    return c->freed >= c->target;
+}
+
+static uint64_t reclaim_frames(uint64_t target)
+{
+    /*
+     * Frees frames of user data by compressing cold ones into the swap pool.
+     * The first walk over the spaces only takes frames that were not used
+     * since the last reclaim. If that is not enough, the second walk takes
+     * the frames whose accessed flags the first walk cleared. Spaces of
+     * processes that have exited are skipped, as their frames are about to
+     * be freed anyway. Returns the number of frames freed.
+     */
+    struct address_space *as;
+    struct reclaim_count c;
+    uint32_t walk;
+
+    c.target = target;
+    c.freed = 0;
+
+    for (walk = 0; walk < 2 && c.freed < target; ++walk)
+        for (as = user_spaces; as != 0 && c.freed < target; as = as->next)
+            if (!as->exiting)
+                (void) walk_user_space(as, reclaim_entry, &c);
+
+    return c.freed;
+}
+
+static uint64_t allocate_user_frame_pa(
+    struct address_space *as, uint32_t flags)
+{
+    /*
+     * Allocates a frame for user data, or for a table of a user space. If
+     * memory has run out, cold user frames are swapped out to make room.
+     */
+    uint64_t p;
+
+    p = allocate_frame_pa(flags | ALLOC_NODE(as->node));
+    if (p == 0 && reclaim_frames(RECLAIM_BATCH))
+        p = allocate_frame_pa(flags | ALLOC_NODE(as->node));
+
+    return p;
+}
+
+uint64_t allocate_page_reclaim_pa(uint32_t flags)
+{
+    /*
+     * Allocates a 2 MiB page. If memory has run out, a page worth of cold
+     * user frames is swapped out, and the allocation is tried again. This
+     * only helps if it empties a page that was carved up for frames.
+     */
+    uint64_t p;
+
+    p = allocate_pages_pa(0, flags);
+    if (p == 0 && reclaim_frames(PAGE_SIZE / FRAME_SIZE))
+        p = allocate_pages_pa(0, flags);
+
+    return p;
+}
+
+static int record_table(struct address_space *as, uint64_t record)
+{
+    /* Adds a table to the record of an address space. */
+    struct record_frame *r = 0;
+    uint64_t p;
+
+    if (as->records_pa)
+        r = (struct record_frame *) pa_to_va(as->records_pa);
+
+    if (r == 0 || r->count == RECORDS_PER_FRAME) {
+        if (charge_memory(as, MEM_TABLES, 1))
+            return -1;
+
+        p = allocate_user_frame_pa(as, ALLOC_NO_ZERO);
+        if (p == 0) {
+            uncharge_memory(as, MEM_TABLES, 1);
+            return -1;
+        }
+
+        r = (struct record_frame *) pa_to_va(p);
+        r->next_pa = as->records_pa;
+        r->count = 0;
+        as->records_pa = p;
+    }
+
+    r->record[r->count++] = record;
+
+    return 0;
+}
+
+static uint64_t next_table_pa(struct address_space *as, uint64_t e_pa,
+    uint32_t attributes, uint64_t level)
+{
+    /*
+     * Returns the physical address of the table that an entry points to,
+     * allocating and recording the table if the entry is not present.
+     * Returns 0 if the table cannot be allocated, or if the entry maps a
+     * large page.
+     */
+    uint64_t p, content;
+
+    content = *(uint64_t *) pa_to_va(e_pa);
+
+    if (!(content & PAGE_PRESENT)) {
+        if (charge_memory(as, MEM_TABLES, 1))
+            return 0;
+
+        p = allocate_user_frame_pa(as, 0);
+        if (p == 0) {
+            uncharge_memory(as, MEM_TABLES, 1);
+            return 0;
+        }
+
+        if (record_table(as, p | level)) {
+            free_frame_pa(p);
+            uncharge_memory(as, MEM_TABLES, 1);
+            return 0;
+        }
+
+        /* Access is restricted by the entries that map the data. */
+        content = p | READ_AND_WRITE | (attributes & USER_ACCESS)
+            | PAGE_PRESENT;
+        *(uint64_t *) pa_to_va(e_pa) = content;
+    } else if (content & PS) {
+        return 0;
+    }
+
+    return clear_lower_bits(content, 12);
+}
+
+static uint64_t get_pde_pa(
+    struct address_space *as, uint64_t v, uint32_t attributes)
+{
+    /*
+     * Walks down to the Page-Directory entry for a virtual address,
+     * allocating the tables along the way. Returns 0 on failure.
+     */
+    uint64_t pdpt_pa, pd_pa;
+
+    /* Level A. */
+    pdpt_pa = next_table_pa(as, entry_pa(as->pml4_pa, pml4_component_va(v)),
+        attributes, TABLE_PDPT);
+    if (pdpt_pa == 0)
+        return 0;
+
+    /* Level B. */
+    pd_pa = next_table_pa(as, entry_pa(pdpt_pa, dir_ptr_component_va(v)),
+        attributes, TABLE_PD);
+    if (pd_pa == 0)
+        return 0;
+
+    /* Level C. */
+    return entry_pa(pd_pa, dir_component_va(v));
+}
+
+static uint64_t get_pte_pa(
+    struct address_space *as, uint64_t v, uint32_t attributes)
+{
+    /*
+     * Walks down to the Page-Table entry for a virtual address, allocating
+     * the tables along the way. Returns 0 on failure.
+     */
+    uint64_t pde_pa, pt_pa;
+
+    pde_pa = get_pde_pa(as, v, attributes);
+    if (pde_pa == 0)
+        return 0;
+
+    /* Level D. */
+    pt_pa = next_table_pa(as, pde_pa, attributes, TABLE_PT);
+    if (pt_pa == 0)
+        return 0;
+
+    return entry_pa(pt_pa, table_component_va(v));
+}
+
+static int map_range(struct address_space *as, uint64_t start_va,
+    uint64_t end_va_excl, uint64_t start_pa, uint32_t attributes)
+{
+    /*
+     * Maps a range with 2 MiB pages.
+     *
+     * Page tables store physical addresses, but addresses need to be converted
+     * to virtual addressed before they can be dereferenced, as the current
+     * in-force paging must be used to access them.
+     */
+
+    uint64_t start_page_va, end_page_va_excl, v, x, pde_pa;
+
+    /* Find superset page range -- a potentially wider range. */
+    start_page_va = truncate_to_page(start_va);
+    end_page_va_excl = align_to_page(end_va_excl);
+
+    if (start_page_va >= end_page_va_excl)
+        return -1;
+
+    if (end_page_va_excl > MAX_MAPPED_VA_EXCL)
+        return -1;
+
+    x = start_pa;
+
+    for (v = start_page_va; v < end_page_va_excl; v += PAGE_SIZE) {
+        pde_pa = get_pde_pa(as, v, attributes);
+        if (pde_pa == 0)
+            return -1;
+
+        /* Map the physical address. */
+        *(uint64_t *) pa_to_va(pde_pa) = x | PS | attributes | PAGE_PRESENT;
+
+        x += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static int map_range_large(struct address_space *as, uint64_t start_va,
+    uint64_t end_va_excl, uint64_t start_pa, uint32_t attributes)
+{
+    /*
+     * Maps a range with 1 GiB pages where the addresses are aligned and a
+     * whole 1 GiB fits, and with 2 MiB pages at the edges. Parts that are
+     * already covered by a 1 GiB page are skipped, so that ranges which
+     * share a page at their edges can be mapped one after the other.
+     */
+
+    uint64_t v, x, end_page_va_excl, pdpt_pa, pdpte_pa, pdpte_content, step;
+
+    /* Find superset page range -- a potentially wider range. */
+    v = truncate_to_page(start_va);
+    x = truncate_to_page(start_pa);
+    end_page_va_excl = align_to_page(end_va_excl);
+
+    if (v >= end_page_va_excl)
+        return -1;
+
+    if (end_page_va_excl > MAX_MAPPED_VA_EXCL)
+        return -1;
+
+    while (v < end_page_va_excl) {
+        /* Level A. */
+        pdpt_pa = next_table_pa(as,
+            entry_pa(as->pml4_pa, pml4_component_va(v)), attributes,
+            TABLE_PDPT);
+        if (pdpt_pa == 0)
+            return -1;
+
+        /* Level B. */
+        pdpte_pa = entry_pa(pdpt_pa, dir_ptr_component_va(v));
+        pdpte_content = *(uint64_t *) pa_to_va(pdpte_pa);
+
+        if ((pdpte_content & PAGE_PRESENT) && (pdpte_content & PS)) {
+            /* Already mapped. */
+            step = GIB_PAGE_SIZE - v % GIB_PAGE_SIZE;
+        } else if (!(pdpte_content & PAGE_PRESENT) && !(v % GIB_PAGE_SIZE)
+            && !(x % GIB_PAGE_SIZE) && end_page_va_excl - v >= GIB_PAGE_SIZE) {
+            /* Map the physical address. */
+            *(uint64_t *) pa_to_va(pdpte_pa)
+                = x | PS | attributes | PAGE_PRESENT;
+            step = GIB_PAGE_SIZE;
+        } else {
+            if (map_range(as, v, v + PAGE_SIZE, x, attributes))
+                return -1;
+
+            step = PAGE_SIZE;
+        }
+
+        v += step;
+        x += step;
+    }
+
+    return 0;
+}
+
+static int map_range_small(struct address_space *as, uint64_t start_va,
+    uint64_t end_va_excl, uint64_t start_pa, uint32_t attributes)
+{
+    /* Maps a range with 4 KiB frames, through a fourth level of tables. */
+
+    uint64_t start_frame_va, end_frame_va_excl, v, x, pte_pa;
+
+    /* Find superset frame range -- a potentially wider range. */
+    start_frame_va = truncate_to_frame(start_va);
+    end_frame_va_excl = align_to_frame(end_va_excl);
+
+    if (start_frame_va >= end_frame_va_excl)
+        return -1;
+
+    if (end_frame_va_excl > MAX_MAPPED_VA_EXCL)
+        return -1;
+
+    x = start_pa;
+
+    for (v = start_frame_va; v < end_frame_va_excl; v += FRAME_SIZE) {
+        pte_pa = get_pte_pa(as, v, attributes);
+        if (pte_pa == 0)
+            return -1;
+
+        /* Map the physical address. */
+        *(uint64_t *) pa_to_va(pte_pa) = x | attributes | PAGE_PRESENT;
+
+        x += FRAME_SIZE;
+    }
+
+    return 0;
+}
+
+static void free_user_data(uint64_t table_pa, uint64_t level)
+{
+    /*
+     * Frees the user data pages (Page Directory) or frames (Page Table) that
+     * a table maps.
+     *
+     * In user mode, PAGE_PRESENT can be used to keep track of allocations.
+     *
+     * However, in kernel mode, all of the virtual space (that is backed by
+     * physical RAM) has PAGE_PRESENT set, so that the kernel can write to
+     * most of RAM. For this reason, PAGE_PRESENT cannot be used as an
+     * allocation indicator in kernel mode. The kernel space never maps user
+     * data, so its tables are skipped by the USER_ACCESS check.
+     */
+    uint64_t k, content;
+
+    for (k = 0; k < PAGE_TABLE_SIZE; k += BYTES_PER_PAGE_TABLE_ENTRY) {
+        content = *(uint64_t *) pa_to_va(table_pa + k);
+        if (level == TABLE_PT && is_swap_entry(content)) {
+            free_blob(swap_blob_pa(content));
+            continue;
+        }
+
+        if ((content & USER_PAGE) != USER_PAGE)
+            continue;
+
+        if (level == TABLE_PT) {
+            if (clear_lower_bits(content, 12) != zero_frame_pa)
+                free_frame_pa(clear_lower_bits(content, 12));
+        } else if (content & PS)
+            free_page_pa(clear_lower_bits(content, 21));
+    }
+}
+
+void free_address_space(struct address_space *as)
+{
+    /*
+     * Frees an address space by walking the record of the tables that were
+     * allocated for it, so the cost follows what was mapped, rather than the
+     * size of the address space. The data that each table maps is freed
+     * along with it.
+     *
+     * The kernel half of a user space refers to the tables of the shared
+     * kernel space, which are not in the record, so they are left alone.
+     * Everything that was charged to the space is given back, including
+     * the kernel stack of its process.
+     */
+    struct record_frame *r;
+    struct address_space **u;
+    uint64_t i, table_pa, level, next_pa;
+
+    for (u = &user_spaces; *u != 0; u = &(*u)->next)
+        if (*u == as) {
+            *u = as->next;
+            break;
+        }
+
+    while (as->records_pa) {
+        r = (struct record_frame *) pa_to_va(as->records_pa);
+
+        for (i = 0; i < r->count; ++i) {
+            table_pa = clear_lower_bits(r->record[i], 12);
+            level = r->record[i] & TABLE_LEVEL;
+
+            if (level != TABLE_PDPT)
+                free_user_data(table_pa, level);
+
+            free_frame_pa(table_pa);
+        }
+
+        next_pa = r->next_pa;
+        free_frame_pa(as->records_pa);
+        as->records_pa = next_pa;
+    }
+
+    free_frame_pa(as->pml4_pa);
+    as->pml4_pa = 0;
+
+    for (i = 0; i < NUM_MEMORY_KINDS; ++i)
+        uncharge_memory(as, (uint32_t) i, as->usage.used[i]);
+
+    if (as->group != 0)
+        --as->group->members;
+}
+
+uint64_t create_kernel_virtual_memory_space(void)
+{
+    /*
+     * Maps physical memory into the kernel space.
+     * This is similar to the kernel space mapping that was created in the
+     * loader.asm file, which maps an arbitrary 512 GiB with 1 GiB pages.
+     * Instead, this maps the RAM ranges from the memory map (up to the
+     * mapped limit), using 1 GiB pages where they are aligned, and 2 MiB
+     * pages at the edges of each range. Holes, such as those for devices,
+     * are left unmapped, except within the first page, which holds the
+     * legacy areas (such as the video memory) that the kernel uses.
+     * This also uses the frame allocator to get the RAM to write the paging
+     * information to.
+     *
+     * This is only done once. Every user space points its kernel half at
+     * the same tables, so kernel PML4 entries must not be added after this.
+     * The mappings are global, so that they stay in the TLB when switching
+     * between processes.
+     */
+    uint32_t i, num_entries;
+    struct pa_range_descriptor *p;
+    uint64_t end_pa_excl;
+
+    kernel_space.node = current_node();
+    kernel_space.records_pa = 0;
+    kernel_space.pml4_pa = allocate_frame_pa(ALLOC_NODE(kernel_space.node));
+    if (kernel_space.pml4_pa == 0)
+        return 0; /* Error. */
+
+    if (map_range(&kernel_space, KERNEL_SPACE_VA,
+            KERNEL_SPACE_VA + PAGE_SIZE, 0,
+            (uint32_t) READ_AND_WRITE | GLOBAL_PAGE))
+        goto clean_up;
+
+    num_entries = *(uint32_t *) MEMORY_MAP_ENTRY_COUNT_VA;
+    p = (struct pa_range_descriptor *) MEMORY_MAP_VA;
+
+    for (i = 0; i < num_entries; ++i, ++p) {
+        if (p->type != MEMORY_TYPE_USABLE && p->type != MEMORY_TYPE_ACPI
+            && p->type != MEMORY_TYPE_ACPI_NVS)
+            continue;
+
+        end_pa_excl = p->pa + p->size;
+        if (end_pa_excl > va_to_pa(MAX_MAPPED_VA_EXCL))
+            end_pa_excl = va_to_pa(MAX_MAPPED_VA_EXCL);
+
+        if (p->pa >= end_pa_excl)
+            continue;
+
+        if (map_range_large(&kernel_space, pa_to_va(p->pa),
+                pa_to_va(end_pa_excl),
+                p->pa, (uint32_t) READ_AND_WRITE | GLOBAL_PAGE))
+            goto clean_up;
+    }
+
+    /*
+     * The kernel virtual allocation area gets its PDPT now, so that the
+     * kernel half of every user PML4 refers to it. Later mappings there
+     * are then seen by all processes.
+     */
+    if (!next_table_pa(&kernel_space,
+            entry_pa(
+                kernel_space.pml4_pa, pml4_component_va(VMALLOC_START_VA)),
+            READ_AND_WRITE, TABLE_PDPT))
+        goto clean_up;
+
+    zero_frame_pa = allocate_frame_pa(ALLOC_NODE(kernel_space.node));
+    if (zero_frame_pa == 0)
+        goto clean_up;
+
+    return kernel_space.pml4_pa;
+
+clean_up:
+    free_address_space(&kernel_space);
+
+    return 0; /* Error. */
+}
+
+static uint64_t lookup_entry_pa(
+    struct address_space *as, uint64_t v, uint64_t level)
+{
+    /*
+     * Walks down to the entry for a virtual address in the table of a given
+     * level, without allocating. Returns 0 if a table along the way is not
+     * present, or is replaced by a large page.
+     */
+    uint64_t e_pa, content, k;
+
+    e_pa = entry_pa(as->pml4_pa, pml4_component_va(v));
+
+    for (k = TABLE_PDPT; k <= level; ++k) {
+        content = *(uint64_t *) pa_to_va(e_pa);
+        if (!(content & PAGE_PRESENT) || (content & PS))
+            return 0;
+
+        e_pa = entry_pa(
+            clear_lower_bits(content, 12), level_component_va(v, k));
+    }
+
+    return e_pa;
+}
+
+static int swap_in_frame(struct address_space *as, uint64_t e_pa)
+{
+    /*
+     * Decompresses a swapped out frame of user data into a new frame, and
+     * maps it. Returns the kind of fault, or -1 on failure.
+     */
+    uint64_t blob_pa, p, start;
+    int64_t size;
+
+    blob_pa = swap_blob_pa(*(uint64_t *) pa_to_va(e_pa));
+
+    if (charge_memory(as, MEM_DATA, 1))
+        return -1;
+
+    if ((p = allocate_user_frame_pa(as, ALLOC_NO_ZERO)) == 0) {
+        uncharge_memory(as, MEM_DATA, 1);
+        return -1;
+    }
+
+    start = read_time_stamp_counter();
+    size = decompress_lz(
+        (const unsigned char *) (pa_to_va(blob_pa) + sizeof(uint16_t)),
+        *(uint16_t *) pa_to_va(blob_pa), (unsigned char *) pa_to_va(p),
+        FRAME_SIZE);
+    swap_in_cycles += read_time_stamp_counter() - start;
+
+    if (size != FRAME_SIZE) {
+        (void) k_printf("ERROR: Paging: Corrupt swapped frame: %lx\n",
+            (unsigned long) blob_pa);
+        free_frame_pa(p);
+        uncharge_memory(as, MEM_DATA, 1);
+        return -1;
+    }
+
+    *(uint64_t *) pa_to_va(e_pa) = p | READ_AND_WRITE | USER_PAGE;
+    free_blob(blob_pa);
+    ++swap_ins;
+
+    return SWAP_FAULT;
+}
+
+static uint64_t source_bytes(
+    uint64_t offset, uint64_t source_size, uint64_t size)
+{
+    /* Returns how much source data falls in a block at an offset. */
+    if (offset >= source_size)
+        return 0;
+
+    return source_size - offset < size ? source_size - offset : size;
+}
+
+static int fault_in_range(struct address_space *as, uint64_t va,
+    uint64_t error_code, uint64_t start_va, uint64_t end_va_excl,
+    uint64_t source_va, uint64_t source_size)
+{
+    /*
+     * Backs the block of a user range that holds a faulting address,
+     * copying in the part of the source data that falls in it. The rest is
+     * cleared. Returns the kind of fault, or -1 on failure.
+     *
+     * Uses a 2 MiB page when the range covers the whole aligned page around
+     * the address, nothing is mapped there yet, and a page is free.
+     * Otherwise uses a 4 KiB frame, so that a small process only costs
+     * kilobytes. A read of a frame with no source data maps the shared zero
+     * frame, read-only.
+     *
+     * Only a partly copied block needs the remainder cleared.
+     */
+    uint64_t v, p = 0, size, offset, x, pde_pa;
+
+    v = truncate_to_page(va);
+    pde_pa = lookup_entry_pa(as, v, TABLE_PD);
+
+    if (v >= start_va && end_va_excl - v >= PAGE_SIZE
+        && (pde_pa == 0 || !(*(uint64_t *) pa_to_va(pde_pa) & PAGE_PRESENT))
+        && !charge_memory(as, MEM_DATA, PAGE_SIZE / FRAME_SIZE)) {
+        size = PAGE_SIZE;
+        x = source_bytes(v - start_va, source_size, size);
+        p = allocate_pages_pa(
+            0, (x == size ? ALLOC_NO_ZERO : 0) | ALLOC_NODE(as->node));
+        if (p == 0)
+            uncharge_memory(as, MEM_DATA, PAGE_SIZE / FRAME_SIZE);
+    }
+
+    if (p == 0) {
+        v = truncate_to_frame(va);
+        size = FRAME_SIZE;
+        x = source_bytes(v - start_va, source_size, size);
+
+        if (x == 0 && !(error_code & PF_WRITE)) {
+            if (map_range_small(as, v, v + size, zero_frame_pa, USER_ACCESS))
+                return -1;
+
+            return ZERO_FAULT;
+        }
+
+        if (charge_memory(as, MEM_DATA, 1))
+            return -1;
+
+        p = allocate_user_frame_pa(as, x == size ? ALLOC_NO_ZERO : 0);
+        if (p == 0) {
+            uncharge_memory(as, MEM_DATA, 1);
+            return -1;
+        }
+    }
+
+    offset = v - start_va;
+
+    if (x)
+        memcpy((void *) pa_to_va(p), (const void *) (source_va + offset), x);
+
+    if (size == PAGE_SIZE) {
+        if (map_range(
+                as, v, v + size, p, (uint32_t) READ_AND_WRITE | USER_ACCESS)) {
+            free_page_pa(p);
+            uncharge_memory(as, MEM_DATA, PAGE_SIZE / FRAME_SIZE);
+            return -1;
+        }
+    } else {
+        if (map_range_small(
+                as, v, v + size, p, (uint32_t) READ_AND_WRITE | USER_ACCESS)) {
+            free_frame_pa(p);
+            uncharge_memory(as, MEM_DATA, 1);
+            return -1;
+        }
+    }
+
+    return x ? IMAGE_FAULT : ANONYMOUS_FAULT;
+}
+
+static int map_resident_frame(
+    struct address_space *as, const struct vma *a, uint64_t va)
+{
+    /*
+     * Maps a frame of the resident copy of the read-only part of an image,
+     * read-only. Returns the kind of fault, or -1 on failure.
+     */
+    uint64_t v, p;
+
+    v = truncate_to_frame(va);
+    p = resident_image[a->resident].frame_pa[(v - a->start_va) >> EXP_4_KIB];
+
+    if (share_pa(p))
+        return -1;
+
+    if (map_range_small(as, v, v + FRAME_SIZE, p, USER_ACCESS)) {
+        free_frame_pa(p);
+        return -1;
+    }
+
+    return SHARED_FAULT;
+}
+
+static int resolve_write_fault(struct address_space *as, uint64_t va)
+{
+    /*
+     * Gives a process a private, writable copy of a shared page or frame
+     * that it writes to. This covers the zero frame, which is replaced with
+     * a cleared frame, and copy-on-write data, which is copied unless this
+     * is the last holder. Returns the kind of fault, or -1 if the address
+     * is not mapped copy-on-write.
+     */
+    uint64_t e_pa, content, data_pa, size, p;
+
+    size = FRAME_SIZE;
+    e_pa = lookup_entry_pa(as, va, TABLE_PT);
+
+    if (e_pa == 0) {
+        size = PAGE_SIZE;
+        e_pa = lookup_entry_pa(as, va, TABLE_PD);
+        if (e_pa == 0 || !(*(uint64_t *) pa_to_va(e_pa) & PS))
+            return -1;
+    }
+
+    content = *(uint64_t *) pa_to_va(e_pa);
+    if (!(content & PAGE_PRESENT))
+        return -1;
+
+    data_pa = clear_lower_bits(content, size == PAGE_SIZE ? 21 : 12);
+
+    if (size == FRAME_SIZE && data_pa == zero_frame_pa) {
+        if (charge_memory(as, MEM_DATA, 1))
+            return -1;
+
+        p = allocate_user_frame_pa(as, 0);
+        if (p == 0) {
+            uncharge_memory(as, MEM_DATA, 1);
+            return -1;
+        }
+
+        *(uint64_t *) pa_to_va(e_pa) = p | READ_AND_WRITE | USER_PAGE;
+        invalidate_page(va);
+
+        return ANONYMOUS_FAULT;
+    }
+
+    if (!(content & COPY_ON_WRITE))
+        return -1;
+
+    if (count_references_pa(data_pa) == 1) {
+        /* The other holders are gone, so take it over. */
+        p = data_pa;
+    } else {
+        if (size == PAGE_SIZE)
+            p = allocate_page_reclaim_pa(ALLOC_NO_ZERO | ALLOC_NODE(as->node));
+        else
+            p = allocate_user_frame_pa(as, ALLOC_NO_ZERO);
+
+        if (p == 0)
+            return -1;
+
+        memcpy((void *) pa_to_va(p), (const void *) pa_to_va(data_pa), size);
+
+        /* Drop the reference to the shared copy. */
+        if (size == PAGE_SIZE)
+            free_page_pa(data_pa);
+        else
+            free_frame_pa(data_pa);
+    }
+
+    *(uint64_t *) pa_to_va(e_pa)
+        = p | (content & PS) | READ_AND_WRITE | USER_PAGE;
+    invalidate_page(va);
+
+    return COPY_FAULT;
+}
+
+int handle_page_fault(
+    struct address_space *as, uint64_t va, uint64_t error_code)
+{
+    /*
+     * Resolves a page fault in a user space. Nothing is mapped when a space
+     * is created, so each block is backed on first touch: the read-only
+     * part of each image is mapped from its resident copy, its data is
+     * copied in, and the bss, stack and anonymous memory are cleared. Writes
+     * to data that is shared after a fork get a private copy, and swapped
+     * out frames are decompressed. Returns the kind of fault (see paging.h),
+     * or -1 if the access is not allowed.
+     */
+    struct vma *a;
+    uint64_t e_pa;
+
+    if (error_code & PF_RESERVED)
+        return -1;
+
+    if ((a = find_vma(&as->vmas, va)) == 0)
+        return -1;
+
+    if (a->type == VMA_GUARD) {
+        (void) k_printf("User stack overflow: %lx\n", (unsigned long) va);
+        return -1;
+    }
+
+    if ((error_code & PF_WRITE) && !(a->flags & VMA_WRITE))
+        return -1;
+
+    if (error_code & PF_PRESENT) {
+        /* A protection violation. Only writes to shared data are let in. */
+        if (!(error_code & PF_WRITE))
+            return -1;
+
+        return resolve_write_fault(as, truncate_to_frame(va));
+    }
+
+    e_pa = lookup_entry_pa(as, va, TABLE_PT);
+    if (e_pa != 0 && is_swap_entry(*(uint64_t *) pa_to_va(e_pa)))
+        return swap_in_frame(as, e_pa);
+
+    if (a->type == VMA_RESIDENT)
+        return map_resident_frame(as, a, va);
+
+    if (a->type == VMA_STACK && truncate_to_frame(va) < as->stack_low_va)
+        as->stack_low_va = truncate_to_frame(va);
+
+    if (a->type != VMA_DATA && !(a->flags & VMA_HUGE)) {
+        /*
+         * Backed a frame at a time, so that a deep stack does not cost more
+         * than it touches. These areas have no source data. Image data is
+         * faulted in over the whole area, so that it is copied from its
+         * source.
+         */
+        return fault_in_range(as, va, error_code, truncate_to_frame(va),
+            truncate_to_frame(va) + FRAME_SIZE, 0, 0);
+    }
+
+    return fault_in_range(as, va, error_code, a->start_va, a->end_va_excl,
+        a->source_va, a->source_size);
+}
+
+static void release_range(
+    struct address_space *as, uint64_t start_va, uint64_t end_va_excl)
+{
+    /*
+     * Unmaps the data in a user range and drops its references, so that
+     * memory that is not shared goes back to the allocator. Swapped out
+     * frames are dropped from the pool. The tables are kept until the space
+     * is freed. A 2 MiB page must lie wholly inside the range. The space
+     * must be loaded, as the TLB entries are invalidated.
+     */
+    uint64_t v, next_va, e_pa, content;
+
+    for (v = start_va; v < end_va_excl; v = next_va) {
+        next_va = truncate_to_page(v) + PAGE_SIZE;
+
+        e_pa = lookup_entry_pa(as, v, TABLE_PD);
+        if (e_pa == 0)
+            continue;
+
+        content = *(uint64_t *) pa_to_va(e_pa);
+        if (!(content & PAGE_PRESENT))
+            continue;
+
+        if (content & PS) {
+            *(uint64_t *) pa_to_va(e_pa) = 0;
+            invalidate_page(v);
+            free_page_pa(clear_lower_bits(content, 21));
+            uncharge_memory(as, MEM_DATA, PAGE_SIZE / FRAME_SIZE);
+            continue;
+        }
+
+        next_va = v + FRAME_SIZE;
+
+        e_pa = entry_pa(clear_lower_bits(content, 12), table_component_va(v));
+        content = *(uint64_t *) pa_to_va(e_pa);
+
+        if (is_swap_entry(content)) {
+            *(uint64_t *) pa_to_va(e_pa) = 0;
+            free_blob(swap_blob_pa(content));
+            continue;
+        }
+
+        if (!(content & PAGE_PRESENT))
+            continue;
+
+        *(uint64_t *) pa_to_va(e_pa) = 0;
+        invalidate_page(v);
+
+        if (clear_lower_bits(content, 12) != zero_frame_pa) {
+            free_frame_pa(clear_lower_bits(content, 12));
+            uncharge_memory(as, MEM_DATA, 1);
+        }
+    }
+}
+
+static struct vma *add_vma(struct address_space *as, uint64_t start_va,
+    uint64_t end_va_excl, uint32_t type, uint32_t flags)
+{
+    /* Adds an area with no source data. Returns 0 on failure. */
+    struct vma a;
+
+    memset(&a, 0, sizeof(struct vma));
+    a.start_va = start_va;
+    a.end_va_excl = end_va_excl;
+    a.type = type;
+    a.flags = flags;
+
+    return insert_vma(&as->vmas, &a);
+}
+
+static struct vma *find_anonymous(struct address_space *as, uint64_t va,
+    uint64_t size, uint64_t *end_va_excl)
+{
+    /*
+     * Returns the anonymous memory area that holds a range, which is rounded
+     * up to whole frames, or 0 if there is none. A range in a huge area must
+     * be whole pages.
+     */
+    struct vma *a;
+    uint64_t end;
+
+    if (size == 0 || va % FRAME_SIZE || va >= USER_STACK_VA
+        || size > USER_STACK_VA)
+        return 0;
+
+    end = align_to_frame(va + size);
+
+    a = find_vma(&as->vmas, va);
+    if (a == 0 || a->type != VMA_ANONYMOUS || end > a->end_va_excl)
+        return 0;
+
+    if ((a->flags & VMA_HUGE) && (va % PAGE_SIZE || end % PAGE_SIZE))
+        return 0;
+
+    *end_va_excl = end;
+
+    return a;
+}
+
+uint64_t map_memory(struct address_space *as, uint64_t size, uint64_t flags)
+{
+    /*
+     * Reserves anonymous memory in a user space, in the first gap above
+     * USER_MMAP_VA that fits. Nothing is mapped until it is touched. A huge
+     * area is aligned to, and sized in, 2 MiB pages, so that every page of
+     * it can be backed with one entry. Returns the start address, or 0 on
+     * failure.
+     */
+    struct vma *a;
+    uint64_t align, v;
+
+    if (size == 0 || size > USER_STACK_VA || flags & ~(uint64_t) MAP_HUGE)
+        return 0;
+
+    align = flags & MAP_HUGE ? PAGE_SIZE : FRAME_SIZE;
+    size = (size + align - 1) & ~(align - 1);
+
+    v = USER_MMAP_VA;
+    while ((a = find_next_vma(&as->vmas, v)) != 0 && a->start_va < v + size)
+        v = (a->end_va_excl + align - 1) & ~(align - 1);
+
+    /* The stack and its guard gap are areas, so this stays below them. */
+    if (v + size > USER_STACK_VA)
+        return 0;
+
+    if (add_vma(as, v, v + size, VMA_ANONYMOUS,
+            VMA_READ | VMA_WRITE | (flags & MAP_HUGE ? VMA_HUGE : 0))
+        == 0)
+        return 0;
+
+    return v;
+}
+
+int unmap_memory(struct address_space *as, uint64_t va, uint64_t size)
+{
+    /*
+     * Unmaps part or all of an anonymous memory area, and frees what was
+     * backing it. The range must lie within one area. Unmapping the middle
+     * splits the area in two.
+     */
+    struct vma *a;
+    uint64_t end_va_excl, old_end_va_excl;
+
+    if ((a = find_anonymous(as, va, size, &end_va_excl)) == 0)
+        return -1;
+
+    if (va > a->start_va && end_va_excl < a->end_va_excl) {
+        old_end_va_excl = a->end_va_excl;
+        a->end_va_excl = va;
+
+        if (add_vma(as, end_va_excl, old_end_va_excl, a->type, a->flags)
+            == 0) {
+            a->end_va_excl = old_end_va_excl;
+            return -1;
+        }
+    } else if (va > a->start_va) {
+        a->end_va_excl = va;
+    } else if (end_va_excl < a->end_va_excl) {
+        /* It stays within its old range, so the tree stays in order. */
+        a->start_va = end_va_excl;
+    } else {
+        (void) remove_vma(&as->vmas, a->start_va);
+    }
+
+    release_range(as, va, end_va_excl);
+
+    return 0;
+}
+
+int discard_memory(struct address_space *as, uint64_t va, uint64_t size)
+{
+    /*
+     * Frees what backs part of an anonymous memory area, but keeps the area,
+     * so that it reads back as zero and is backed again when it is touched.
+     */
+    uint64_t end_va_excl;
+
+    if (find_anonymous(as, va, size, &end_va_excl) == 0)
+        return -1;
+
+    release_range(as, va, end_va_excl);
+
+    return 0;
+}
+
+static int create_user_pml4(struct address_space *as,
+    struct memory_account *group, uint64_t limit)
+{
+    /* Memory comes from the node of the CPU that creates the space. */
+    as->node = current_node();
+    as->records_pa = 0;
+    as->tlb_flush_pending = 0;
+    as->exiting = 0;
+    memset(&as->ws, 0, sizeof(struct working_set));
+    memset(&as->usage, 0, sizeof(struct memory_account));
+    as->usage.limit = limit;
+    as->group = group;
+
+    if (charge_memory(as, MEM_TABLES, 1))
+        return -1;
+
+    as->pml4_pa = allocate_user_frame_pa(as, 0);
+    if (as->pml4_pa == 0) {
+        uncharge_memory(as, MEM_TABLES, 1);
+        return -1;
+    }
+
+    as->next = user_spaces;
+    user_spaces = as;
+
+    if (group != 0)
+        ++group->members;
+
+    /*
+     * Every user space also has a kernel space. It is the same for every
+     * process, so the kernel half of the PML4 refers to the shared kernel
+     * tables rather than copies of them.
+     */
+    memcpy((void *) pa_to_va(as->pml4_pa + KERNEL_PML4E_OFFSET),
+        (const void *) pa_to_va(kernel_space.pml4_pa + KERNEL_PML4E_OFFSET),
+        PAGE_TABLE_SIZE - KERNEL_PML4E_OFFSET);
+
+    return 0;
+}
+
+static int find_resident_image(uint64_t source_va, uint64_t size)
+{
+    /*
+     * Returns the index of the resident copy of the read-only part of an
+     * executable image, making it the first time. Returns -1 on failure.
+     */
+    struct resident_image *r;
+    uint64_t i, x;
+    uint32_t k;
+
+    for (k = 0; k < num_resident_images; ++k)
+        if (resident_image[k].source_va == source_va)
+            return (int) k;
+
+    if (num_resident_images == MAX_RESIDENT_IMAGES) {
+        (void) k_printf("ERROR: Paging: Too many resident images\n");
+        return -1;
+    }
+
+    r = resident_image + num_resident_images;
+    r->source_va = source_va;
+    r->num_frames = ((const struct exec_header *) source_va)->read_only_size
+        >> EXP_4_KIB;
+
+    for (i = 0; i < r->num_frames; ++i) {
+        /* The part can run past the end of the image, and is cleared there. */
+        x = size > i * FRAME_SIZE ? size - i * FRAME_SIZE : 0;
+        if (x > FRAME_SIZE)
+            x = FRAME_SIZE;
+
+        r->frame_pa[i]
+            = allocate_frame_pa(x == FRAME_SIZE ? ALLOC_NO_ZERO : 0);
+        if (r->frame_pa[i] == 0) {
+            while (i) free_frame_pa(r->frame_pa[--i]);
 
-static int map_range(uint64_t pml4_pa, uint64_t start_va, uint64_t end_va_excl,
-    uint64_t start_pa, uint32_t attributes)
+            return -1;
+        }
+
+        memcpy((void *) pa_to_va(r->frame_pa[i]),
+            (const void *) (source_va + i * FRAME_SIZE), x);
+    }
+
+    return (int) num_resident_images++;
+}
+
+static int map_image(struct address_space *as, uint64_t start_va,
+    uint64_t source_va, uint64_t size, int executable)
 {
     /*
-     * Page tables store physical addresses, but addresses need to be converted
-     * to virtual addressed before they can be dereferenced, as the current
-     * in-force paging must be used to access them.
+     * Adds the areas of an image that is mapped at a virtual address, from
+     * the copy that was loaded at boot. Nothing is mapped yet.
      */
+    const struct exec_header *h = (const struct exec_header *) source_va;
+    struct vma *a;
+    uint64_t data_va;
+    int resident;
 
-    uint64_t start_page_va, end_page_va_excl, v, x, p, pml4e_pa, pml4e_content,
-        pdpte_pa, pdpte_content, pde_pa;
+    if (size < sizeof(struct exec_header) || h->read_only_size == 0
+        || h->read_only_size % FRAME_SIZE
+        || h->read_only_size > align_to_frame(size)
+        || h->read_only_size > MAX_IMAGE_FRAMES * FRAME_SIZE
+        || h->memory_size < h->read_only_size
+        || h->memory_size > USER_MMAP_VA - start_va
+        || (executable
+            && (h->entry_va < start_va
+                || h->entry_va >= start_va + h->read_only_size))) {
+        (void) k_printf("ERROR: Paging: Invalid user image: %lx\n",
+            (unsigned long) source_va);
+        return -1;
+    }
 
-    /* Find superset page range -- a potentially wider range. */
-    start_page_va = truncate_to_page(start_va);
-    end_page_va_excl = align_to_page(end_va_excl);
+    if ((resident = find_resident_image(source_va, size)) == -1)
+        return -1;
 
-    if (start_page_va >= end_page_va_excl)
+    data_va = start_va + h->read_only_size;
+
+    a = add_vma(as, start_va, data_va, VMA_RESIDENT, VMA_READ);
+    if (a == 0)
         return -1;
 
-    if (end_page_va_excl > MAX_MAPPED_VA_EXCL)
+    a->resident = (uint32_t) resident;
+
+    /*
+     * The writable data. The file may be padded out past the data, or end
+     * before the .bss does, so only what is in both is copied in. The rest
+     * is cleared on demand.
+     */
+    if (align_to_frame(start_va + h->memory_size) > data_va) {
+        a = add_vma(as, data_va, align_to_frame(start_va + h->memory_size),
+            VMA_DATA, VMA_READ | VMA_WRITE);
+        if (a == 0)
+            return -1;
+
+        a->source_va = source_va + h->read_only_size;
+        a->source_size = (size < h->memory_size ? size : h->memory_size)
+            - h->read_only_size;
+    }
+
+    return 0;
+}
+
+int create_user_virtual_memory_space(struct address_space *as,
+    struct memory_account *group, uint64_t exec_start_va, uint64_t exec_size)
+{
+    /*
+     * Nothing but the kernel half is mapped yet. The images and the stack
+     * are backed by the page-fault handler as the process touches them. The
+     * read-only part of each image is mapped from its resident copy, and
+     * only the writable data is copied. The stack grows down from
+     * USER_STACK_VA as far as its limit, below which is a guard gap.
+     *
+     * The memory of the space is charged to it, with the default limit, and
+     * to the group, if one is given.
+     */
+    uint64_t stack_limit_va = USER_STACK_VA - USER_STACK_LIMIT;
+
+    init_vma_tree(&as->vmas);
+
+    if (map_image(as, USER_EXEC_START_VA, exec_start_va, exec_size, 1)
+        || map_image(as, USER_LIB_VA, pa_to_va(USER_LIB_PA), USER_LIB_SIZE, 0)
+        || add_vma(as, stack_limit_va, USER_STACK_VA, VMA_STACK,
+               VMA_READ | VMA_WRITE)
+            == 0
+        || add_vma(as, stack_limit_va - USER_STACK_GUARD_SIZE, stack_limit_va,
+               VMA_GUARD, 0)
+            == 0)
         return -1;
 
-    x = start_pa;
+    as->stack_low_va = USER_STACK_VA;
 
-    for (v = start_page_va; v < end_page_va_excl; v += PAGE_SIZE) {
-        /* Level A. */
-        pml4e_pa = pml4_pa + pml4_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
-        pml4e_content = *(uint64_t *) pa_to_va(pml4e_pa);
-        if (!(pml4e_content & PAGE_PRESENT)) {
-            /* Allocate page for the Page-Directory-Pointer Table. */
-            p = allocate_page_pa();
-            if (p == 0)
+    return create_user_pml4(
+        as, group, (uint64_t) PROCESS_MEMORY_LIMIT >> EXP_4_KIB);
+}
+
+static int copy_swap_entry(
+    struct address_space *child, uint64_t va, uint64_t content)
+{
+    /* Gives a child space its own copy of a swapped out frame. */
+    uint64_t pte_pa, blob_pa, copy_pa, spare_pa = 0;
+
+    pte_pa = get_pte_pa(child, va, USER_ACCESS);
+    if (pte_pa == 0)
+        return -1;
+
+    blob_pa = swap_blob_pa(content);
+    copy_pa = store_blob(
+        (const unsigned char *) (pa_to_va(blob_pa) + sizeof(uint16_t)),
+        *(uint16_t *) pa_to_va(blob_pa), &spare_pa);
+    if (copy_pa == 0)
+        return -1;
+
+    *(uint64_t *) pa_to_va(pte_pa) = swap_entry(copy_pa);
+
+    return 0;
+}
+
+static int share_user_data(struct address_space *child, uint64_t table_pa,
+    uint64_t level, uint64_t start_va)
+{
+    /*
+     * Maps the user data under a table of a parent space into a child space.
+     * Writable data is made read-only in both, and marked copy-on-write, so
+     * that the first write from either side gets a private copy. Swapped out
+     * frames are copied within the pool. Level zero is the PML4, where only
+     * the user half is walked.
+     */
+    uint64_t k, end_k, e_va, content, v, data_pa;
+    uint32_t attributes;
+
+    end_k = level ? PAGE_TABLE_SIZE / BYTES_PER_PAGE_TABLE_ENTRY
+                  : pml4_component_va(KERNEL_SPACE_VA);
+
+    for (k = 0; k < end_k; ++k) {
+        e_va = pa_to_va(entry_pa(table_pa, k));
+        content = *(uint64_t *) e_va;
+        v = start_va + (k << (39 - 9 * level));
+
+        if (level == TABLE_PT && is_swap_entry(content)) {
+            if (copy_swap_entry(child, v, content))
                 return -1;
 
-            *(uint64_t *) pa_to_va(pml4e_pa) = p | attributes | PAGE_PRESENT;
+            continue;
         }
-        pml4e_content = *(uint64_t *) pa_to_va(pml4e_pa);
 
-        /* Level B. */
-        pdpte_pa = clear_lower_bits(pml4e_content, 12)
-            + dir_ptr_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
-        pdpte_content = *(uint64_t *) pa_to_va(pdpte_pa);
-        if (!(pdpte_content & PAGE_PRESENT)) {
-            /* Allocate page for Page-Directory. */
-            p = allocate_page_pa();
-            if (p == 0)
+        if ((content & USER_PAGE) != USER_PAGE)
+            continue;
+
+        if (level < TABLE_PT && !(content & PS)) {
+            if (share_user_data(
+                    child, clear_lower_bits(content, 12), level + 1, v))
                 return -1;
 
-            *(uint64_t *) pa_to_va(pdpte_pa) = p | attributes | PAGE_PRESENT;
+            continue;
         }
-        pdpte_content = *(uint64_t *) pa_to_va(pdpte_pa);
 
-        /* Level C. */
-        pde_pa = clear_lower_bits(pdpte_content, 12)
-            + dir_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
+        if (content & READ_AND_WRITE) {
+            content = (content & ~(uint64_t) READ_AND_WRITE) | COPY_ON_WRITE;
+            *(uint64_t *) e_va = content;
+        }
 
-        /* Map the physical address. */
-        *(uint64_t *) pa_to_va(pde_pa) = x | PS | attributes | PAGE_PRESENT;
+        data_pa = clear_lower_bits(content, level == TABLE_PT ? 12 : 21);
+        attributes = (uint32_t) (content & (USER_ACCESS | COPY_ON_WRITE));
 
-        x += PAGE_SIZE;
+        /* Data is charged to the child too. Space freed on failure. */
+        if ((content & COPY_ON_WRITE)
+            && charge_memory(child, MEM_DATA,
+                level == TABLE_PT ? 1 : PAGE_SIZE / FRAME_SIZE))
+            return -1;
+
+        /* The zero frame is never freed, so it is not counted. */
+        if (data_pa != zero_frame_pa && share_pa(data_pa))
+            return -1;
+
+        if (level == TABLE_PT) {
+            if (map_range_small(
+                    child, v, v + FRAME_SIZE, data_pa, attributes)) {
+                if (data_pa != zero_frame_pa)
+                    free_frame_pa(data_pa);
+
+                return -1;
+            }
+        } else if (map_range(child, v, v + PAGE_SIZE, data_pa, attributes)) {
+            free_page_pa(data_pa);
+            return -1;
+        }
     }
 
     return 0;
 }
 
-static int free_user_data_range(
-    uint64_t pml4_pa, uint64_t start_va, uint64_t end_va_excl)
+int copy_user_virtual_memory_space(
+    struct address_space *child, struct address_space *parent)
 {
     /*
-     * Frees data pages in a range for user space.
-     *
-     * In user mode, PAGE_PRESENT can be used to keep track of allocations.
-     *
-     * However, in kernel mode, all of the virtual space (that is backed by
-     * physical RAM) has PAGE_PRESENT set, so that the kernel can write to
-     * most of RAM. For this reason, PAGE_PRESENT cannot be used as an
-     * allocation indicator in kernel mode. The kernel needs to otherwise
-     * remember which data pages it has requested to be allocated, and then
-     * free them explicitly.
+     * Creates a copy of a user space for a forked process. Page tables are
+     * built for the child, but the data is shared copy-on-write. The TLB
+     * entries of the parent must be flushed afterwards, as its writable
+     * data becomes read-only. The child has the limit and group of the
+     * parent.
      */
+    if (create_user_pml4(child, parent->group, parent->usage.limit))
+        return -1;
 
-    uint64_t start_page_va, end_page_va_excl, v, p, pml4e_pa, pml4e_content,
-        pdpte_pa, pdpte_content, pde_pa, pde_content;
+    memcpy(&child->vmas, &parent->vmas, sizeof(struct vma_tree));
+    child->stack_low_va = parent->stack_low_va;
 
-    /* Find superset page range -- a potentially wider range. */
-    start_page_va = truncate_to_page(start_va);
-    end_page_va_excl = align_to_page(end_va_excl);
+    if (share_user_data(child, parent->pml4_pa, 0, 0)) {
+        free_address_space(child);
+        return -1;
+    }
 
-    if (start_page_va >= end_page_va_excl)
+    return 0;
+}
+
+static uint64_t hash_frame(uint64_t pa, int *zero)
+{
+    /* Hashes the contents of a frame, and notes if it is all zero. */
+    const uint64_t *w = (const uint64_t *) pa_to_va(pa);
+    uint64_t h = FNV_OFFSET_BASIS, any = 0;
+    uint32_t k;
+
+    for (k = 0; k < FRAME_SIZE / sizeof(uint64_t); ++k) {
+        any |= w[k];
+        h = (h ^ w[k]) * FNV_PRIME;
+    }
+
+    *zero = !any;
+
+    return h;
+}
+
+static int merge_with_candidate(struct merge_candidate *c,
+    struct address_space *as, uint64_t e_va, uint64_t va, uint64_t pa)
+{
+    /*
+     * Maps a candidate frame in place of an identical frame, copy-on-write,
+     * and drops the reference to the frame it replaces. The candidate is
+     * write-protected too. Returns -1 if the candidate has changed, or is
+     * not identical.
+     */
+    uint64_t c_pa, c_content;
+
+    c_pa = lookup_entry_pa(c->as, c->va, TABLE_PT);
+    if (c_pa == 0)
         return -1;
 
-    if (end_page_va_excl > MAX_MAPPED_VA_EXCL)
+    c_content = *(uint64_t *) pa_to_va(c_pa);
+    if (!(c_content & PAGE_PRESENT) || clear_lower_bits(c_content, 12) != c->pa
+        || memcmp((const void *) pa_to_va(c->pa), (const void *) pa_to_va(pa),
+            FRAME_SIZE))
         return -1;
 
-    for (v = start_page_va; v < end_page_va_excl; v += PAGE_SIZE) {
-        /* Level A. */
-        pml4e_pa = pml4_pa + pml4_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
-        pml4e_content = *(uint64_t *) pa_to_va(pml4e_pa);
-        if (pml4e_content & PAGE_PRESENT) {
-            /* Level B. */
-            pdpte_pa = clear_lower_bits(pml4e_content, 12)
-                + dir_ptr_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
-            pdpte_content = *(uint64_t *) pa_to_va(pdpte_pa);
-            if (pdpte_content & PAGE_PRESENT) {
-                /* Level C. */
-                pde_pa = clear_lower_bits(pdpte_content, 12)
-                    + dir_component_va(v) * BYTES_PER_PAGE_TABLE_ENTRY;
-
-                pde_content = *(uint64_t *) pa_to_va(pde_pa);
-
-                /* Free the physical data page. */
-                if (pde_content & PAGE_PRESENT & USER_ACCESS) {
-                    p = clear_lower_bits(pde_content, 21);
-                    free_page_pa(p);
-                    *(uint64_t *) pa_to_va(pde_pa) = 0;
-                }
-            }
-        }
+    if (share_pa(c->pa))
+        return -1;
+
+    if (c_content & READ_AND_WRITE) {
+        *(uint64_t *) pa_to_va(c_pa)
+            = (c_content & ~(uint64_t) READ_AND_WRITE) | COPY_ON_WRITE;
+        invalidate_user_page(c->as, c->va);
     }
 
+    *(uint64_t *) e_va = c->pa | COPY_ON_WRITE | USER_PAGE;
+    invalidate_user_page(as, va);
+    free_frame_pa(pa);
+
     return 0;
 }
 
-void free_4_level_paging(uint64_t pml4_pa)
+static void merge_frame(struct address_space *as, uint64_t e_va, uint64_t va)
 {
-    /* Assumes that data pages have already been freed. */
-    uint64_t i, j, pml4e_pa, pml4e_content, pdpt_pa, pdpte_pa, pdpte_content,
-        pd_pa;
+    /*
+     * Merges a private or copy-on-write frame of user data with an identical
+     * frame seen earlier in the pass. A cleared frame is replaced with the
+     * zero frame. Otherwise, the frame becomes a candidate itself.
+     */
+    struct merge_candidate *c;
+    uint64_t pa, h;
+    uint32_t k;
+    int zero;
 
-    for (i = 0; i < PAGE_TABLE_SIZE; i += BYTES_PER_PAGE_TABLE_ENTRY) {
-        /* Level A. */
-        pml4e_pa = pml4_pa + i;
-        pml4e_content = *(uint64_t *) pa_to_va(pml4e_pa);
-        if (pml4e_content & PAGE_PRESENT) {
-            pdpt_pa = clear_lower_bits(pml4e_content, 12);
-            for (j = 0; j < PAGE_TABLE_SIZE; j += BYTES_PER_PAGE_TABLE_ENTRY) {
-                /* Level B. */
-                pdpte_pa = pdpt_pa + j;
-                pdpte_content = *(uint64_t *) pa_to_va(pdpte_pa);
-                if (pdpte_content & PAGE_PRESENT) {
-                    pd_pa = clear_lower_bits(pdpte_content, 12);
-                    free_page_pa(pd_pa);
-                }
-            }
-            free_page_pa(pdpt_pa);
+    pa = clear_lower_bits(*(uint64_t *) e_va, 12);
+    h = hash_frame(pa, &zero);
+    ++merge_scanned;
+
+    if (zero) {
+        *(uint64_t *) e_va = zero_frame_pa | USER_PAGE;
+        invalidate_user_page(as, va);
+        free_frame_pa(pa);
+        uncharge_memory(as, MEM_DATA, 1);
+        ++merge_zeroed;
+        return;
+    }
+
+    for (k = 0; k < MERGE_PROBES; ++k) {
+        c = merge_table + ((h + k) & (MERGE_TABLE_SIZE - 1));
+
+        if (c->pa == 0) {
+            c->hash = h;
+            c->pa = pa;
+            c->as = as;
+            c->va = va;
+            return;
+        }
+
+        /* Data that is already shared needs nothing. */
+        if (c->pa == pa)
+            return;
+
+        if (c->hash == h && !merge_with_candidate(c, as, e_va, va, pa)) {
+            ++merge_merged;
+            return;
         }
     }
-    free_page_pa(pml4_pa);
 }
 
-uint64_t create_kernel_virtual_memory_space(void)
+static int merge_entry(struct address_space *as, uint64_t e_va, uint64_t va,
+    uint64_t level, void *arg)
+{
+    /* Merges writable and copy-on-write frames. 2 MiB pages are left alone. */
+    (void) arg;
+
+    if (level == TABLE_PT
+        && (*(uint64_t *) e_va & (READ_AND_WRITE | COPY_ON_WRITE)))
+        merge_frame(as, e_va, va);
+
+    return 0;
+}
+
+void start_merge_pass(void)
+{
+    memset(merge_table, 0, sizeof(merge_table));
+    merge_scanned = 0;
+    merge_merged = 0;
+    merge_zeroed = 0;
+    merge_start = read_time_stamp_counter();
+}
+
+void merge_same_frames(struct address_space *as)
 {
     /*
-     * Maps all of physical memory into the kernel space.
-     * This is similar to the kernel space mapping that was created in the
-     * loader.asm file, except that this uses 2 MiB pages instead of 1 GiB
-     * pages, and this stops at the limit of physical memory, rather than
-     * the arbitrary 512 GiB mapping. This also uses the physical memory
-     * allocator to get the RAM to write the paging information to.
-     * The kernel already has access to all of the RAM, so this is done
-     * to prevent the same RAM from being used elsewhere, and to make the
-     * of the paging hierarchy independently free-able.
-     */
-    uint64_t pml4_pa;
-
-    pml4_pa = allocate_page_pa();
-    if (pml4_pa == 0)
-        return 0; /* Error. */
+     * Scans a user space for frames of data that are identical to frames
+     * seen earlier in the pass, in this space or another, and maps a single
+     * read-only copy in their place. Writes then get a private copy through
+     * the copy-on-write path.
+     */
+    (void) walk_user_space(as, merge_entry, 0);
+}
 
-    if (map_range(pml4_pa, KERNEL_SPACE_VA, pa_to_va(max_pa_excl), 0,
-            (uint32_t) READ_AND_WRITE)) {
-        free_4_level_paging(pml4_pa);
-        return 0; /* Error. */
+uint64_t finish_merge_pass(void)
+{
+    /* Reports a pass that freed frames. Returns the number that it freed. */
+    uint64_t cycles, saved;
+
+    cycles = read_time_stamp_counter() - merge_start;
+    saved = merge_merged + merge_zeroed;
+    merge_total_saved += saved;
+    merge_total_cycles += cycles;
+
+    if (saved)
+        (void) k_printf("Same-page merging: scanned: %lu, merged: %lu, "
+                        "zero: %lu, cycles: %lu, total saved: %lu KiB, "
+                        "total cycles: %lu\n",
+            merge_scanned, merge_merged, merge_zeroed, cycles,
+            merge_total_saved * FRAME_SIZE >> 10, merge_total_cycles);
+
+    return saved;
+}
+
+static int sample_entry(struct address_space *as, uint64_t e_va, uint64_t va,
+    uint64_t level, void *arg)
+{
+    /*
+     * Counts data that was accessed and written since the last sample, and
+     * then clears those flags. A 2 MiB page counts as all of its frames.
+     */
+    struct working_set *ws = (struct working_set *) arg;
+    uint64_t content = *(uint64_t *) e_va, n;
+
+    n = level == TABLE_PT ? 1 : PAGE_SIZE / FRAME_SIZE;
+
+    if (content & ACCESSED)
+        ws->hot += n;
+    else
+        ws->cold += n;
+
+    if (content & DIRTY)
+        ws->dirty += n;
+
+    /*
+     * The processor only sets the flags again when it walks the tables, so
+     * the TLB entry must go too.
+     */
+    if (content & (ACCESSED | DIRTY)) {
+        *(uint64_t *) e_va = content & ~(uint64_t) (ACCESSED | DIRTY);
+        invalidate_user_page(as, va);
     }
 
-    return pml4_pa;
+    return 0;
 }
 
-uint64_t create_user_virtual_memory_space(
-    uint64_t exec_start_va, uint64_t exec_size)
+void sample_working_set(struct address_space *as, uint64_t tick)
 {
-    uint64_t pml4_pa, v, p, s, x, y;
+    /*
+     * Replaces the working-set figures of a user space with what was used
+     * since the last sample. Each sample starts a new interval.
+     */
+    struct working_set ws;
+
+    memset(&ws, 0, sizeof(struct working_set));
+    (void) walk_user_space(as, sample_entry, &ws);
+    ws.tick = tick;
+    as->ws = ws;
+}
 
+void report_swap(void)
+{
     /*
-     * Every user space also has a kernel space.
-     * This kernel space will be the same. The only reason why it is written to
-     * new memory pages is so that the whole paging structure can be freed when
-     * the process terminates, without affecting the other processes.
+     * Reports the frames that were swapped out, how well they compressed,
+     * and the average cost of compressing and decompressing a frame.
      */
-    pml4_pa = create_kernel_virtual_memory_space();
-    if (pml4_pa == 0)
-        return 0; /* Error. */
+    if (!swap_outs)
+        return;
+
+    (void) k_printf("Swap: out: %lu, in: %lu, rejected: %lu, pool: %lu KiB\n",
+        swap_outs, swap_ins, swap_rejects, pool_frames * FRAME_SIZE >> 10);
+    (void) k_printf("Swap: compressed to %lu%%, cycles: out: %lu, in: %lu\n",
+        swap_packed_bytes * 100 / (swap_outs * FRAME_SIZE),
+        swap_out_cycles / (swap_outs + swap_rejects),
+        swap_ins ? swap_in_cycles / swap_ins : 0);
+}
 
-    v = exec_start_va;
-    s = exec_size;
-    y = USER_EXEC_START_VA;
+int map_kernel_page(uint64_t va, uint64_t pa)
+{
+    /* Maps a 2 MiB page in the kernel virtual allocation area. */
+    uint64_t pde_pa;
 
-    while (s) {
-        p = allocate_page_pa();
-        if (p == 0)
-            goto clean_up;
+    if (va < VMALLOC_START_VA || va >= VMALLOC_END_VA_EXCL || va % PAGE_SIZE
+        || pa % PAGE_SIZE)
+        return -1;
 
-        if (s <= (uint64_t) PAGE_SIZE)
-            x = s;
-        else
-            x = (uint64_t) PAGE_SIZE;
+    pde_pa = get_pde_pa(&kernel_space, va, READ_AND_WRITE);
+    if (pde_pa == 0)
+        return -1;
 
-        memcpy((void *) pa_to_va(p), (const void *) v, x);
+    *(uint64_t *) pa_to_va(pde_pa)
+        = pa | PS | READ_AND_WRITE | GLOBAL_PAGE | PAGE_PRESENT;
 
-        if (map_range(pml4_pa, y, y + PAGE_SIZE, p,
-                (uint32_t) READ_AND_WRITE | USER_ACCESS)) {
-            free_page_pa(p);
-            goto clean_up;
-        }
+    return 0;
+}
+
+uint64_t unmap_kernel_page(uint64_t va)
+{
+    /*
+     * Unmaps a page in the kernel virtual allocation area, and removes it
+     * from the TLB. Returns its physical address, or 0 if it was not
+     * mapped.
+     */
+    uint64_t pde_pa, content;
+
+    if (va < VMALLOC_START_VA || va >= VMALLOC_END_VA_EXCL || va % PAGE_SIZE)
+        return 0;
+
+    pde_pa = get_pde_pa(&kernel_space, va, READ_AND_WRITE);
+    if (pde_pa == 0)
+        return 0;
+
+    content = *(uint64_t *) pa_to_va(pde_pa);
+    if (!(content & PAGE_PRESENT))
+        return 0;
+
+    *(uint64_t *) pa_to_va(pde_pa) = 0;
+    invalidate_page(va);
+
+    return clear_lower_bits(content, 21);
+}
+
+void init_tlb(void)
+{
+    /*
+     * Enables global pages and, when supported, PCIDs. Must be called while
+     * the kernel space is loaded with a PCID of zero.
+     */
+    pcid_enabled = enable_tlb_features();
+    loaded_cr3 = kernel_space.pml4_pa;
+
+    (void) k_printf("PCID: %s\n", pcid_enabled ? "enabled" : "unsupported");
+}
+
+void load_address_space(uint64_t pml4_pa, uint32_t pcid, int *flush_pending)
+{
+    /*
+     * Loads an address space. When PCIDs are enabled, its TLB entries are
+     * tagged with the PCID and kept while other address spaces are loaded,
+     * so they are only flushed when *flush_pending is set (for example,
+     * when a PCID is given to a new process). The cr3 write is skipped
+     * when the address space is already loaded.
+     */
+    uint64_t cr3;
 
-        v += x;
-        s -= x;
-        y += PAGE_SIZE;
+    cr3 = pml4_pa | (pcid_enabled ? pcid : 0);
+
+    if (cr3 == loaded_cr3 && !*flush_pending)
+        return;
+
+    loaded_cr3 = cr3;
+
+    if (pcid_enabled && !*flush_pending)
+        cr3 |= CR3_NO_FLUSH;
+
+    *flush_pending = 0;
+    switch_pml4_pa(cr3);
+}
+
+#if BOOT_CHECKS || BENCHMARKS
+static int touch_user_space(struct address_space *as)
+{
+    /*
+     * Backs the images and stack of a new user space through the page-fault
+     * handler, as the first run of a process would. Each stack frame is read
+     * before it is written, so that it goes through the zero frame.
+     */
+    const struct vma *a;
+    uint64_t v;
+
+    for (a = find_next_vma(&as->vmas, 0); a != 0;
+        a = find_next_vma(&as->vmas, a->end_va_excl)) {
+        if (a->type != VMA_RESIDENT && a->type != VMA_DATA)
+            continue;
+
+        for (v = a->start_va; v < a->end_va_excl; v += FRAME_SIZE)
+            if (handle_page_fault(as, v, PF_USER) == -1)
+                return -1;
     }
 
-    /* User stack. */
-    p = allocate_page_pa();
-    if (p == 0)
-        goto clean_up;
+    for (v = USER_STACK_VA - CHECK_STACK_SIZE; v < USER_STACK_VA;
+        v += FRAME_SIZE) {
+        if (handle_page_fault(as, v, PF_USER) == -1
+            || handle_page_fault(as, v, PF_PRESENT | PF_WRITE | PF_USER) == -1)
+            return -1;
+    }
 
-    /* Map the start of the page. */
-    if (map_range(pml4_pa, USER_STACK_VA - (uint64_t) PAGE_SIZE, USER_STACK_VA,
-            p, (uint32_t) READ_AND_WRITE | USER_ACCESS)) {
-        free_page_pa(p);
-        goto clean_up;
+    return 0;
+}
+#endif
+
+#if BENCHMARKS
+static uint64_t time_switches(uint64_t user_pml4_pa, int flush)
+{
+    /*
+     * Times round trips between the kernel space and a user space, reading
+     * each user frame while the user space is loaded. Returns the average
+     * number of cycles per round trip.
+     */
+    uint64_t start, v, sum = 0;
+    uint32_t i;
+    int f;
+
+    start = read_time_stamp_counter();
+
+    for (i = 0; i < SWITCH_BENCHMARK_ROUNDS; ++i) {
+        f = flush;
+        load_address_space(user_pml4_pa, 1, &f);
+
+        for (v = USER_STACK_VA - CHECK_STACK_SIZE; v < USER_STACK_VA;
+            v += FRAME_SIZE)
+            sum += *(volatile uint64_t *) v;
+
+        for (v = USER_EXEC_START_VA; v < USER_EXEC_START_VA + USER_C_SIZE;
+            v += FRAME_SIZE)
+            sum += *(volatile uint64_t *) v;
+
+        f = flush;
+        load_address_space(kernel_space.pml4_pa, 0, &f);
     }
 
-    return pml4_pa;
+    (void) sum;
 
-clean_up:
-    (void) free_user_data_range(pml4_pa, USER_EXEC_START_VA, exec_size);
-    free_4_level_paging(pml4_pa);
+    return (read_time_stamp_counter() - start) / SWITCH_BENCHMARK_ROUNDS;
+}
 
-    return 0; /* Error. */
+int benchmark_address_space_switch(void)
+{
+    /*
+     * Compares switches that flush the TLB with switches that keep the
+     * entries of each PCID. Must be called with the kernel space loaded.
+     */
+    struct address_space as;
+    uint64_t flush_cycles, keep_cycles;
+    int f = 1;
+
+    if (create_user_virtual_memory_space(
+            &as, 0, pa_to_va(USER_C_PA), USER_C_SIZE))
+        return -1;
+
+    if (touch_user_space(&as)) {
+        free_address_space(&as);
+        return -1;
+    }
+
+    /* Warm up, and flush anything left over from an earlier PCID 1 user. */
+    load_address_space(as.pml4_pa, 1, &f);
+    f = 0;
+    load_address_space(kernel_space.pml4_pa, 0, &f);
+
+    flush_cycles = time_switches(as.pml4_pa, 1);
+    keep_cycles = time_switches(as.pml4_pa, 0);
+
+    (void) k_printf("Address space switch (cycles): flush: %lu, keep: %lu\n",
+        flush_cycles, keep_cycles);
+
+    free_address_space(&as);
+
+    return 0;
+}
+#endif
+
+#if BOOT_CHECKS
+int check_address_space_teardown(uint32_t cycles)
+{
+    /*
+     * Creates, touches and frees a user space repeatedly, and checks that
+     * all of the memory comes back.
+     */
+    struct address_space as;
+    uint64_t before;
+    uint32_t i;
+
+    /*
+     * The first cycle may carve a page for frames that is then kept, and
+     * makes the resident copy of the image.
+     */
+    if (create_user_virtual_memory_space(
+            &as, 0, pa_to_va(USER_C_PA), USER_C_SIZE))
+        return -1;
+
+    (void) touch_user_space(&as);
+    free_address_space(&as);
+
+    before = count_free_physical_memory();
+
+    for (i = 0; i < cycles; ++i) {
+        if (create_user_virtual_memory_space(
+                &as, 0, pa_to_va(USER_C_PA), USER_C_SIZE))
+            return -1;
+
+        if (touch_user_space(&as)) {
+            free_address_space(&as);
+            return -1;
+        }
+
+        free_address_space(&as);
+    }
+
+    if (count_free_physical_memory() != before) {
+        (void) k_printf("ERROR: Address space teardown: Drift: %lu -> %lu\n",
+            (unsigned long) before,
+            (unsigned long) count_free_physical_memory());
+        return -1;
+    }
+
+    return 0;
 }
+#endif
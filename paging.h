@@ -27,14 +27,115 @@
 #define PAGING_H
 
 #include "stdint.h"
+#include "vma.h"
+
+/* Frames of user data found by the last working-set sample. */
+struct working_set {
+    uint64_t hot;   /* Accessed since the sample before. */
+    uint64_t cold;  /* Mapped, but not accessed since the sample before. */
+    uint64_t dirty; /* Written since the sample before. */
+    uint64_t tick;  /* Timer count when it was taken. */
+};
+
+/* Kinds of memory that are charged, such as MEM_DATA (see defs.h). */
+#define NUM_MEMORY_KINDS 3
+
+/*
+ * Memory charged to a process or to a group of processes, in frames. Data
+ * is counted in every space that maps it, so shared data is counted more
+ * than once. The zero frame and the read-only part of images are free.
+ */
+struct memory_account {
+    uint64_t used[NUM_MEMORY_KINDS];
+    uint64_t peak[NUM_MEMORY_KINDS]; /* High-water marks. */
+    uint64_t total;
+    uint64_t total_peak;
+    uint64_t limit; /* Most frames in total. */
+    uint32_t members; /* User spaces charged to it, for a group. */
+};
+
+/*
+ * An address space. The record lists the tables that were allocated for it,
+ * so that it can be freed without scanning for them. The areas describe the
+ * layout of the user half, and how each part of it is backed. User spaces
+ * are kept in a list, so that memory can be reclaimed from any of them.
+ */
+struct address_space {
+    uint64_t pml4_pa;
+    uint64_t records_pa; /* Newest record frame. */
+    uint32_t node;       /* NUMA node that its memory is allocated from. */
+    struct vma_tree vmas;
+    uint64_t stack_low_va; /* Lowest stack frame touched so far. */
+    struct working_set ws;
+    struct memory_account usage;
+    struct memory_account *group; /* Also charged, if set. */
+    /* Set when its TLB entries must be flushed the next time it is loaded. */
+    int tlb_flush_pending;
+    int exiting; /* Its process has exited, and it is about to be freed. */
+    struct address_space *next; /* User spaces. */
+};
+
+/*
+ * Header at the start of a user image, written by the user linker script.
+ * The read-only part (text and rodata) is a whole number of frames, and is
+ * followed by the writable data. The image in memory runs on past the end
+ * of the file, for the .bss. The shared user library has no entry.
+ */
+struct exec_header {
+    uint64_t entry_va;
+    uint64_t read_only_size;
+    uint64_t memory_size;
+};
+
+/* Page-fault error code bits. */
+#define PF_PRESENT  1        /* Clear if the page was not present. */
+#define PF_WRITE    (1 << 1) /* Set for a write access. */
+#define PF_USER     (1 << 2) /* Set for an access from user mode. */
+#define PF_RESERVED (1 << 3) /* Set for a reserved bit in an entry. */
+
+/* Kinds of resolved page faults. */
+#define IMAGE_FAULT     0 /* Data copied in from the executable image. */
+#define ZERO_FAULT      1 /* Read of untouched memory: the zero frame. */
+#define ANONYMOUS_FAULT 2 /* Cleared memory was allocated. */
+#define COPY_FAULT      3 /* Write to copy-on-write data. */
+#define SHARED_FAULT    4 /* Read-only image frame, mapped shared. */
+#define SWAP_FAULT      5 /* Compressed frame, decompressed. */
+#define NUM_FAULT_KINDS 6
 
 /* From paging.asm file. */
 void switch_pml4_pa(uint64_t new_pml4_start_pa);
+int enable_tlb_features(void);
+uint64_t read_time_stamp_counter(void);
+void invalidate_page(uint64_t va);
 
 /* From paging.c file. */
-void free_4_level_paging(uint64_t pml4_pa);
+void free_address_space(struct address_space *as);
 uint64_t create_kernel_virtual_memory_space(void);
-uint64_t create_user_virtual_memory_space(
-    uint64_t exec_start_va, uint64_t exec_size);
+int map_kernel_page(uint64_t va, uint64_t pa);
+uint64_t unmap_kernel_page(uint64_t va);
+uint64_t allocate_page_reclaim_pa(uint32_t flags);
+int create_user_virtual_memory_space(struct address_space *as,
+    struct memory_account *group, uint64_t exec_start_va, uint64_t exec_size);
+int copy_user_virtual_memory_space(
+    struct address_space *child, struct address_space *parent);
+int handle_page_fault(
+    struct address_space *as, uint64_t va, uint64_t error_code);
+void start_merge_pass(void);
+void merge_same_frames(struct address_space *as);
+uint64_t finish_merge_pass(void);
+void report_swap(void);
+int charge_memory(struct address_space *as, uint32_t kind, uint64_t frames);
+void sample_working_set(struct address_space *as, uint64_t tick);
+uint64_t map_memory(struct address_space *as, uint64_t size, uint64_t flags);
+int unmap_memory(struct address_space *as, uint64_t va, uint64_t size);
+int discard_memory(struct address_space *as, uint64_t va, uint64_t size);
+void init_tlb(void);
+void load_address_space(uint64_t pml4_pa, uint32_t pcid, int *flush_pending);
+#if BENCHMARKS
+int benchmark_address_space_switch(void);
+#endif
+#if BOOT_CHECKS
+int check_address_space_teardown(uint32_t cycles);
+#endif
 
 #endif
@@ -42,11 +42,23 @@
 #define SLEEPING_PROCESS 3
 #define KILL_PROCESS     4
 
+/* Timer events between same-page merging passes. */
+#define MERGE_INTERVAL (10 * EVENTS_PER_SECOND)
+
+/* Timer events between working-set samples of a process. */
+#define WORKING_SET_INTERVAL EVENTS_PER_SECOND
+
 #define RFLAGS_INTERRUPT_ENABLE (1 << 9)
 #define RFLAGS_RESERVED_BIT_1   (1 << 1)
 
 struct process_control_block {
-    uint64_t pml4_pa;
+    struct address_space as;
+    /*
+     * Process-Context Identifier. This is the array index plus one, as the
+     * kernel space uses zero, so it is recycled with the slot. The TLB
+     * entries of a reused PCID are flushed the next time that it is loaded.
+     */
+    uint32_t pcid;
     uint64_t kernel_stack_page_va;
     struct interrupt_stack_frame *isf_va;
     /* Used to save the rsp value before process switch. */
@@ -57,6 +69,9 @@ struct process_control_block {
     uint32_t state;
 
     int sleep_reason;
+
+    /* Page faults resolved for the process, by kind. */
+    uint64_t faults[NUM_FAULT_KINDS];
 };
 
 struct task_state_segment {
@@ -77,14 +92,51 @@ struct switch_stack_frame {
 
 static struct process_control_block pcb[MAX_PROCESSES];
 
+/*
+ * Memory charged to each group of processes. A group is a process that is
+ * prepared at start up, and the processes forked from it. An entry with no
+ * members is free. There is one entry per process slot, so a process that
+ * has a slot can always start a group.
+ */
+static struct memory_account group_account[MAX_PROCESSES];
+
 static struct linked_list ready_list;
 static struct linked_list sleep_list;
 static struct linked_list kill_list;
 
 static int current_index = -1;
 
+/* Set while waiting for a process to become ready. */
+static int idling = 0;
+
+/* Timer count at which the next same-page merging pass is due. */
+static uint64_t next_merge_tick = 0;
+
+/* Process slot that the next working-set sample starts looking from. */
+static int sample_index = 0;
+
+extern uint64_t timer_counter;
+
 extern struct task_state_segment tss;
 
+static void print_faults(int i)
+{
+    (void) k_printf("faults: shared: %lu, image: %lu, zero: %lu, "
+                    "anonymous: %lu, copy: %lu, swap: %lu\n",
+        pcb[i].faults[SHARED_FAULT], pcb[i].faults[IMAGE_FAULT],
+        pcb[i].faults[ZERO_FAULT], pcb[i].faults[ANONYMOUS_FAULT],
+        pcb[i].faults[COPY_FAULT], pcb[i].faults[SWAP_FAULT]);
+    (void) k_printf("working set: hot: %lu, cold: %lu, dirty: %lu\n",
+        pcb[i].as.ws.hot, pcb[i].as.ws.cold, pcb[i].as.ws.dirty);
+    (void) k_printf("memory peak: data: %lu KiB, tables: %lu KiB, "
+                    "total: %lu KiB\n",
+        pcb[i].as.usage.peak[MEM_DATA] * (FRAME_SIZE >> 10),
+        pcb[i].as.usage.peak[MEM_TABLES] * (FRAME_SIZE >> 10),
+        pcb[i].as.usage.total_peak * (FRAME_SIZE >> 10));
+    (void) k_printf("stack: %lu KiB\n",
+        (USER_STACK_VA - pcb[i].as.stack_low_va) >> 10);
+}
+
 static void print_pcb(void)
 {
     char *state_str;
@@ -117,7 +169,8 @@ static void print_pcb(void)
             }
             (void) k_printf("state: %s\n", state_str);
 
-            (void) k_printf("pml4_pa: %lx\n", pcb[i].pml4_pa);
+            (void) k_printf("pml4_pa: %lx\n", pcb[i].as.pml4_pa);
+            (void) k_printf("pcid: %u\n", pcb[i].pcid);
             (void) k_printf(
                 "kernel_stack_page_va: %lx\n", pcb[i].kernel_stack_page_va);
 
@@ -125,36 +178,69 @@ static void print_pcb(void)
             (void) k_printf("rsp_save: %lu\n", pcb[i].rsp_save);
 
             (void) k_printf("sleep_reason: %ld\n", pcb[i].sleep_reason);
+            print_faults((int) i);
         }
     }
 }
 
-static int prepare_process(uint64_t bin_pa, uint64_t bin_size)
+static struct memory_account *new_group(void)
+{
+    /* Returns a free group account, set up with the default limit. */
+    int g;
+
+    for (g = 0; g < MAX_PROCESSES; ++g)
+        if (group_account[g].members == 0) {
+            memset(group_account + g, 0, sizeof(struct memory_account));
+            group_account[g].limit
+                = (uint64_t) GROUP_MEMORY_LIMIT >> EXP_4_KIB;
+            return group_account + g;
+        }
+
+    return 0;
+}
+
+static int find_free_slot(void)
 {
+    /* Returns the index of an unused process slot, or -1 if there is none. */
     int i;
-    uint64_t p;
 
     for (i = 0; i < MAX_PROCESSES; ++i)
         if (pcb[i].state == UNUSED_PROCESS)
-            break;
+            return i;
 
-    if (i == MAX_PROCESSES)
-        return -1; /* Failure: No free process slots. */
+    return -1;
+}
+
+static int launch_process(int i, const struct interrupt_stack_frame *isf)
+{
+    /*
+     * Gives a process slot, with its address space already created, a
+     * kernel stack that will enter user mode with the given frame, and
+     * makes it ready. The address space is freed on failure.
+     */
+    uint64_t p;
 
-    if (!(p = allocate_page_pa()))
+    /*
+     * The kernel stack is always written before it is read. It comes from
+     * the same node as the rest of the process, and is charged to it. Cold
+     * user frames are swapped out to make room if memory has run out.
+     */
+    if (charge_memory(&pcb[i].as, MEM_KERNEL, PAGE_SIZE / FRAME_SIZE)
+        || !(p = allocate_page_reclaim_pa(
+                 ALLOC_NO_ZERO | ALLOC_NODE(pcb[i].as.node)))) {
+        free_address_space(&pcb[i].as);
         return -1;
+    }
 
     pcb[i].kernel_stack_page_va = pa_to_va(p);
 
-    if (!(pcb[i].pml4_pa
-            = create_user_virtual_memory_space(pa_to_va(bin_pa), bin_size))) {
-        free_page_pa(p);
-        return -1;
-    }
+    pcb[i].pcid = (uint32_t) i + 1;
+    pcb[i].as.tlb_flush_pending = 1;
 
     pcb[i].isf_va
         = (struct interrupt_stack_frame *) (pcb[i].kernel_stack_page_va
             + PAGE_SIZE - sizeof(struct interrupt_stack_frame));
+    *pcb[i].isf_va = *isf;
 
     /*
      * Prepare the stack for first time entry in the
@@ -165,13 +251,6 @@ static int prepare_process(uint64_t bin_pa, uint64_t bin_size)
     ((struct switch_stack_frame *) pcb[i].rsp_save)->interrupt_return
         = (uint64_t) interrupt_return;
 
-    pcb[i].isf_va->rip = USER_EXEC_START_VA;
-    pcb[i].isf_va->cs = (uint64_t) USER_CODE_SELECTOR;
-    pcb[i].isf_va->rflags
-        = (uint64_t) (RFLAGS_INTERRUPT_ENABLE | RFLAGS_RESERVED_BIT_1);
-    pcb[i].isf_va->rsp = (uint64_t) USER_STACK_VA;
-    pcb[i].isf_va->ss = (uint64_t) USER_DATA_SELECTOR;
-
     /* Set pid. pids loop within the same array index. */
     if (!pcb[i].pid || pcb[i].pid > U32_MAX - MAX_PROCESSES)
         pcb[i].pid = (uint32_t) i;
@@ -193,6 +272,65 @@ static int prepare_process(uint64_t bin_pa, uint64_t bin_size)
     return 0;
 }
 
+static int prepare_process(uint64_t bin_pa, uint64_t bin_size)
+{
+    struct interrupt_stack_frame isf;
+    struct memory_account *group;
+    int i;
+
+    if ((i = find_free_slot()) == -1)
+        return -1; /* Failure: No free process slots. */
+
+    /* Each process that is prepared starts a group. */
+    if ((group = new_group()) == 0) {
+        (void) k_printf("ERROR: No free memory group\n");
+        return -1;
+    }
+
+    if (create_user_virtual_memory_space(
+            &pcb[i].as, group, pa_to_va(bin_pa), bin_size))
+        return -1;
+
+    memset(&isf, 0, sizeof(struct interrupt_stack_frame));
+    isf.rip = ((const struct exec_header *) pa_to_va(bin_pa))->entry_va;
+    isf.cs = (uint64_t) USER_CODE_SELECTOR;
+    isf.rflags = (uint64_t) (RFLAGS_INTERRUPT_ENABLE | RFLAGS_RESERVED_BIT_1);
+    isf.rsp = (uint64_t) USER_STACK_VA;
+    isf.ss = (uint64_t) USER_DATA_SELECTOR;
+
+    return launch_process(i, &isf);
+}
+
+int fork(const struct interrupt_stack_frame *isf_va)
+{
+    /*
+     * Creates a copy of the running process, which shares its memory
+     * copy-on-write. The child resumes from the same system call, with a
+     * return value of zero. Returns the pid of the child, or -1 on failure.
+     */
+    struct interrupt_stack_frame isf;
+    int i;
+
+    if ((i = find_free_slot()) == -1)
+        return -1;
+
+    if (copy_user_virtual_memory_space(&pcb[i].as, &pcb[current_index].as))
+        return -1;
+
+    /* The writable data of the parent is now read-only. */
+    pcb[current_index].as.tlb_flush_pending = 1;
+    load_address_space(pcb[current_index].as.pml4_pa,
+        pcb[current_index].pcid, &pcb[current_index].as.tlb_flush_pending);
+
+    isf = *isf_va;
+    isf.rax = 0;
+
+    if (launch_process(i, &isf))
+        return -1;
+
+    return (int) pcb[i].pid;
+}
+
 int start_init_process(void)
 {
     /*
@@ -235,7 +373,8 @@ int start_init_process(void)
     pcb[current_index].state = RUNNING_PROCESS;
 
     tss.rsp0 = pcb[current_index].kernel_stack_page_va + PAGE_SIZE;
-    switch_pml4_pa(pcb[current_index].pml4_pa);
+    load_address_space(pcb[current_index].as.pml4_pa, pcb[current_index].pcid,
+        &pcb[current_index].as.tlb_flush_pending);
 
     (void) k_printf("About to enter process...\n");
 
@@ -243,12 +382,54 @@ int start_init_process(void)
     return 0;
 }
 
+static int merge_same_pages(void)
+{
+    /*
+     * Runs a same-page merging pass over the user spaces of every live
+     * process, when one is due. Returns 1 if a pass was run.
+     */
+    int i;
+
+    if (timer_counter < next_merge_tick)
+        return 0;
+
+    next_merge_tick = timer_counter + MERGE_INTERVAL;
+
+    start_merge_pass();
+
+    for (i = 0; i < MAX_PROCESSES; ++i)
+        if (pcb[i].state != UNUSED_PROCESS && pcb[i].state != KILL_PROCESS)
+            merge_same_frames(&pcb[i].as);
+
+    (void) finish_merge_pass();
+
+    return 1;
+}
+
+static void idle(void)
+{
+    /*
+     * Waits for a process to become ready, doing background work in the
+     * meantime. This runs on the kernel stack of the process that gave up
+     * execution. Interrupts are only enabled while halted, so that the
+     * timer and keyboard can wake processes up.
+     */
+    idling = 1;
+
+    while (!ready_list.used_count)
+        if (!refill_zero_pool() && !merge_same_pages())
+            wait_for_interrupt();
+
+    idling = 0;
+}
+
 static void schedule(void)
 {
     int old_current_index;
 
     /* No ready processes. */
-    stop(!ready_list.used_count);
+    if (!ready_list.used_count)
+        idle();
 
     old_current_index = current_index;
 
@@ -258,7 +439,8 @@ static void schedule(void)
     pcb[current_index].state = RUNNING_PROCESS;
 
     tss.rsp0 = pcb[current_index].kernel_stack_page_va + PAGE_SIZE;
-    switch_pml4_pa(pcb[current_index].pml4_pa);
+    load_address_space(pcb[current_index].as.pml4_pa, pcb[current_index].pcid,
+        &pcb[current_index].as.tlb_flush_pending);
 
     switch_process(
         &pcb[old_current_index].rsp_save, pcb[current_index].rsp_save);
@@ -266,6 +448,10 @@ static void schedule(void)
 
 void give_up_execution(void)
 {
+    /* There is no running process to switch away from while idling. */
+    if (idling)
+        return;
+
     stop(push_to_tail_ll(&ready_list, current_index));
     pcb[current_index].state = READY_PROCESS;
 
@@ -281,6 +467,29 @@ void sleep(int sleep_reason)
     schedule();
 }
 
+void sample_working_sets(void)
+{
+    /*
+     * Called on each timer tick. Samples the working set of the next live
+     * process, so that the cost is spread out and sampling goes on while
+     * processes are busy. A process is sampled at most once per interval.
+     */
+    int k, i;
+
+    for (k = 0; k < MAX_PROCESSES; ++k) {
+        i = sample_index;
+        sample_index = (sample_index + 1) % MAX_PROCESSES;
+
+        if (pcb[i].state == UNUSED_PROCESS || pcb[i].state == KILL_PROCESS)
+            continue;
+
+        if (timer_counter - pcb[i].as.ws.tick >= WORKING_SET_INTERVAL)
+            sample_working_set(&pcb[i].as, timer_counter);
+
+        return;
+    }
+}
+
 void wake_up(int sleep_reason)
 {
     /*
@@ -312,11 +521,133 @@ void exit(void)
 {
     stop(push_to_tail_ll(&kill_list, current_index));
     pcb[current_index].state = KILL_PROCESS;
+    pcb[current_index].as.exiting = 1;
 
     wake_up(INIT_PROCESS_SLEEP);
     schedule();
 }
 
+int page_fault(uint64_t va, uint64_t error_code)
+{
+    /*
+     * Resolves a page fault in the user space of the running process. This
+     * also covers faults taken by the kernel on user addresses during a
+     * system call. Returns -1 if the fault could not be resolved.
+     */
+    int kind;
+
+    if (current_index == -1 || va >= NON_CANONICAL_MIN_VA)
+        return -1;
+
+    kind = handle_page_fault(&pcb[current_index].as, va, error_code);
+    if (kind == -1)
+        return -1;
+
+    ++pcb[current_index].faults[kind];
+
+    return 0;
+}
+
+struct address_space *current_address_space(void)
+{
+    /* Returns the user space of the running process. */
+    return &pcb[current_index].as;
+}
+
+static int find_live_slot(uint64_t pid)
+{
+    /*
+     * Returns the slot of a live process, or -1 if there is none. A pid of
+     * zero is the running process. pids loop within the same array index,
+     * so the slot follows from the pid.
+     */
+    int i;
+
+    if (pid == 0)
+        return current_index;
+
+    i = (int) (pid % MAX_PROCESSES);
+    if (pcb[i].pid != pid || pcb[i].state == UNUSED_PROCESS
+        || pcb[i].state == KILL_PROCESS)
+        return -1;
+
+    return i;
+}
+
+static int is_descendant(int i, int ancestor)
+{
+    /*
+     * Returns 1 if a process is another one, or was forked from it through
+     * processes that are still live.
+     */
+    int k;
+
+    for (k = 0; k < MAX_PROCESSES && i != -1; ++k) {
+        if (i == ancestor)
+            return 1;
+
+        if (pcb[i].ppid == KERNEL_PID)
+            return 0;
+
+        i = find_live_slot(pcb[i].ppid);
+    }
+
+    return 0;
+}
+
+struct address_space *find_address_space(uint64_t pid)
+{
+    /* Returns the user space of a live process, or 0 if there is none. */
+    int i;
+
+    if ((i = find_live_slot(pid)) == -1)
+        return 0;
+
+    return &pcb[i].as;
+}
+
+int may_limit_memory(uint64_t pid, int group)
+{
+    /*
+     * Returns 1 if the running process may set the memory limit of a
+     * process, which must be itself or a descendant of it. A group limit
+     * may only be set by a member that all of the other live members
+     * descend from, so that no process can squeeze its parent.
+     */
+    int i, k;
+
+    if ((i = find_live_slot(pid)) == -1 || !is_descendant(i, current_index))
+        return 0;
+
+    if (!group)
+        return 1;
+
+    if (pcb[i].as.group != pcb[current_index].as.group)
+        return 0;
+
+    for (k = 0; k < MAX_PROCESSES; ++k)
+        if (pcb[k].state != UNUSED_PROCESS && pcb[k].state != KILL_PROCESS
+            && pcb[k].as.group == pcb[i].as.group
+            && !is_descendant(k, current_index))
+            return 0;
+
+    return 1;
+}
+
+struct memory_account *find_memory_account(uint64_t pid, int group)
+{
+    /*
+     * Returns the memory account of a live process, or of its group, or 0
+     * if there is none. A pid of zero is the running process.
+     */
+    struct address_space *as;
+
+    if ((as = find_address_space(pid)) == 0)
+        return 0;
+
+    return group ? as->group : &as->usage;
+}
+
 void clean_up(void)
 {
     /* Called by init process. Cleans up all killed processes. */
@@ -329,8 +660,12 @@ void clean_up(void)
             stop(pcb[index].state != KILL_PROCESS);
 
             /* Clean up. */
+            (void) k_printf("pid %lu exited. ", (uint64_t) pcb[index].pid);
+            print_faults(index);
+            report_swap();
+
             free_page_pa(va_to_pa(pcb[index].kernel_stack_page_va));
-            free_4_level_paging(pcb[index].pml4_pa);
+            free_address_space(&pcb[index].as);
 
             memset(pcb + index, 0, sizeof(struct process_control_block));
 
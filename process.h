@@ -26,11 +26,22 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include "interrupt.h"
+#include "paging.h"
+#include "stdint.h"
+
 int start_init_process(void);
 void give_up_execution(void);
 void sleep(int sleep_reason);
 void wake_up(int sleep_reason);
+void sample_working_sets(void);
 void exit(void);
+int fork(const struct interrupt_stack_frame *isf_va);
+int page_fault(uint64_t va, uint64_t error_code);
+struct address_space *current_address_space(void);
+struct address_space *find_address_space(uint64_t pid);
+struct memory_account *find_memory_account(uint64_t pid, int group);
+int may_limit_memory(uint64_t pid, int group);
 void clean_up(void);
 
 #endif
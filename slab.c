@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Slab allocator.
+ *
+ * Kernel objects are allocated from caches, each of which hands out objects
+ * of a single size. A cache gets its memory from the frame allocator, one
+ * 4 KiB frame (a slab) at a time. Each slab starts with a header, followed
+ * by an array of free object indices, followed by the objects.
+ *
+ * The free objects of a slab are linked through the index array, rather
+ * than through the objects themselves, so that an object keeps its
+ * constructed state while it is free. The constructor is only run when a
+ * slab is created, and objects should be returned in the constructed state.
+ *
+ * A cache keeps its slabs on three lists: partial, full and empty. Objects
+ * are taken from partial slabs first, so that used objects are packed
+ * together. One empty slab is kept to absorb alloc/free cycles, and any
+ * other slab is returned to the frame allocator once it is empty.
+ *
+ * kmalloc has a cache for each power of two size class, up to half a
+ * frame. The slab is found from the object address, so kfree does not need
+ * the size.
+ *
+ * This file also builds natively (without TOUCANIX) for the host test.
+ */
+
+#include "slab.h"
+#include "address.h"
+#include "allocator.h"
+
+#ifdef TOUCANIX
+#include "defs.h"
+#include "k_printf.h"
+#else
+#include "test/test_defs.h"
+#include <stdio.h>
+#endif
+
+/* Marks a frame as a slab, to catch invalid frees. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* End of a free index chain. */
+#define NO_FREE_OBJECT 0xffff
+
+#define OBJECT_ALIGN 8
+
+#define KMALLOC_MIN_EXP 4
+#define KMALLOC_MAX_EXP (EXP_4_KIB - 1)
+#define KMALLOC_CLASSES (KMALLOC_MAX_EXP - KMALLOC_MIN_EXP + 1)
+
+#define align_up(a, n) (((a) + (n) - 1) / (n) * (n))
+
+/* Offset of the objects in a slab of n objects. */
+#define objects_offset(n)                                                     \
+    align_up(sizeof(struct slab) + ((n) - 1) * sizeof(uint16_t), OBJECT_ALIGN)
+
+/* Truncates an object address down to the start of its slab. */
+#define object_to_slab(p)                                                     \
+    ((struct slab *) ((uint64_t) (p) >> EXP_4_KIB << EXP_4_KIB))
+
+struct slab {
+    uint32_t magic;
+    uint16_t used;
+    uint16_t free; /* Index of the first free object. */
+    struct slab_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    uint16_t next_free[1]; /* Sized by the cache. */
+};
+
+static struct slab_cache *all_caches = 0;
+
+static struct slab_cache kmalloc_cache[KMALLOC_CLASSES];
+
+static const char *kmalloc_name[KMALLOC_CLASSES] = { "kmalloc-16",
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512",
+    "kmalloc-1024", "kmalloc-2048" };
+
+static void push_slab(struct slab **list, struct slab *s)
+{
+    s->prev = 0;
+    s->next = *list;
+
+    if (*list)
+        (*list)->prev = s;
+
+    *list = s;
+}
+
+static void remove_slab(struct slab **list, struct slab *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+
+    if (s->next)
+        s->next->prev = s->prev;
+
+    s->prev = 0;
+    s->next = 0;
+}
+
+int init_slab_cache(struct slab_cache *c, const char *name,
+    uint32_t object_size, void (*constructor)(void *object))
+{
+    uint32_t n;
+
+    if (object_size == 0)
+        return -1;
+
+    object_size = align_up(object_size, OBJECT_ALIGN);
+
+    /* Fit as many objects as possible, after the header and index array. */
+    n = (FRAME_SIZE - sizeof(struct slab)) / (object_size + sizeof(uint16_t));
+    while (n && objects_offset(n) + n * object_size > FRAME_SIZE)
+        --n;
+
+    if (n == 0)
+        return -1; /* Too big for a slab. */
+
+    c->name = name;
+    c->object_size = object_size;
+    c->slab_objects = n;
+    c->objects_offset = objects_offset(n);
+    c->constructor = constructor;
+
+    c->partial = 0;
+    c->full = 0;
+    c->empty = 0;
+
+    c->num_slabs = 0;
+    c->used_objects = 0;
+    c->allocations = 0;
+    c->frees = 0;
+    c->failures = 0;
+
+    c->next = all_caches;
+    all_caches = c;
+
+    return 0;
+}
+
+static struct slab *create_slab(struct slab_cache *c)
+{
+    struct slab *s;
+    uint64_t p;
+    uint32_t i;
+
+    /* Objects are not cleared, only constructed. */
+    if (!(p = allocate_frame_pa(ALLOC_NO_ZERO)))
+        return 0;
+
+    s = (struct slab *) pa_to_va(p);
+    s->magic = SLAB_MAGIC;
+    s->used = 0;
+    s->free = 0;
+    s->cache = c;
+    s->prev = 0;
+    s->next = 0;
+
+    for (i = 0; i < c->slab_objects; ++i) {
+        s->next_free[i]
+            = (uint16_t) (i + 1 < c->slab_objects ? i + 1 : NO_FREE_OBJECT);
+
+        if (c->constructor)
+            c->constructor(
+                (char *) s + c->objects_offset + i * c->object_size);
+    }
+
+    ++c->num_slabs;
+
+    return s;
+}
+
+void *allocate_object(struct slab_cache *c)
+{
+    struct slab *s;
+    uint32_t i;
+
+    if (c->partial) {
+        s = c->partial;
+    } else {
+        if (c->empty) {
+            s = c->empty;
+            c->empty = 0;
+        } else if (!(s = create_slab(c))) {
+            ++c->failures;
+            return 0;
+        }
+
+        push_slab(&c->partial, s);
+    }
+
+    i = s->free;
+    s->free = s->next_free[i];
+    ++s->used;
+
+    if (s->used == c->slab_objects) {
+        remove_slab(&c->partial, s);
+        push_slab(&c->full, s);
+    }
+
+    ++c->used_objects;
+    ++c->allocations;
+
+    return (char *) s + c->objects_offset + i * c->object_size;
+}
+
+void free_object(void *object)
+{
+    struct slab *s;
+    struct slab_cache *c;
+    uint64_t offset;
+    uint32_t i;
+
+    if (object == 0)
+        return;
+
+    s = object_to_slab(object);
+    c = s->cache;
+    offset = (uint64_t) ((char *) object - (char *) s);
+
+    if (s->magic != SLAB_MAGIC || offset < c->objects_offset
+        || (offset - c->objects_offset) % c->object_size
+        || s->used == 0) {
+        (void) k_printf("ERROR: Slab: Invalid free: %lx\n",
+            (unsigned long) object);
+        return;
+    }
+
+    i = (uint32_t) ((offset - c->objects_offset) / c->object_size);
+
+    if (s->used == c->slab_objects) {
+        remove_slab(&c->full, s);
+        push_slab(&c->partial, s);
+    }
+
+    s->next_free[i] = s->free;
+    s->free = (uint16_t) i;
+    --s->used;
+
+    --c->used_objects;
+    ++c->frees;
+
+    if (s->used == 0) {
+        remove_slab(&c->partial, s);
+
+        if (c->empty) {
+            s->magic = 0;
+            free_frame_pa(va_to_pa((uint64_t) s));
+            --c->num_slabs;
+        } else {
+            c->empty = s;
+        }
+    }
+}
+
+int init_kmalloc(void)
+{
+    uint32_t k;
+
+    for (k = 0; k < KMALLOC_CLASSES; ++k)
+        if (init_slab_cache(kmalloc_cache + k, kmalloc_name[k],
+                (uint32_t) 1 << (k + KMALLOC_MIN_EXP), 0))
+            return -1;
+
+    return 0;
+}
+
+void *kmalloc(uint32_t size)
+{
+    /*
+     * Allocates from the smallest size class that fits. Larger requests
+     * should use the page allocator, or vmalloc. The memory is not cleared.
+     */
+    uint32_t k;
+
+    for (k = 0; k < KMALLOC_CLASSES; ++k)
+        if (size <= (uint32_t) 1 << (k + KMALLOC_MIN_EXP))
+            return allocate_object(kmalloc_cache + k);
+
+    return 0;
+}
+
+void kfree(void *p)
+{
+    free_object(p);
+}
+
+int report_slab_caches(void)
+{
+    struct slab_cache *c;
+
+    if (k_printf("Slab caches: name size slabs used allocs frees fails\n")
+        == -1)
+        return -1;
+
+    for (c = all_caches; c != 0; c = c->next)
+        if (k_printf("%s %lu %lu %lu %lu %lu %lu\n", c->name,
+                (unsigned long) c->object_size,
+                (unsigned long) c->num_slabs, (unsigned long) c->used_objects,
+                (unsigned long) c->allocations, (unsigned long) c->frees,
+                (unsigned long) c->failures)
+            == -1)
+            return -1;
+
+    return 0;
+}
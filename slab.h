@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "stdint.h"
+
+struct slab;
+
+/* Object cache. */
+struct slab_cache {
+    const char *name;
+    uint32_t object_size;    /* Including padding. */
+    uint32_t slab_objects;   /* Objects per slab. */
+    uint32_t objects_offset; /* Start of the objects within a slab. */
+    /* Called once per object, when its slab is created. Can be 0. */
+    void (*constructor)(void *object);
+
+    /* Slab lists. */
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty; /* At most one is kept. */
+
+    /* Usage. */
+    uint64_t num_slabs;
+    uint64_t used_objects;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t failures;
+
+    struct slab_cache *next; /* All caches, for reports. */
+};
+
+int init_slab_cache(struct slab_cache *c, const char *name,
+    uint32_t object_size, void (*constructor)(void *object));
+void *allocate_object(struct slab_cache *c);
+void free_object(void *object);
+int init_kmalloc(void);
+void *kmalloc(uint32_t size);
+void kfree(void *p);
+int report_slab_caches(void);
+
+#endif
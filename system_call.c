@@ -1,6 +1,7 @@
 #include "defs.h"
 #include "interrupt.h"
 #include "k_printf.h"
+#include "paging.h"
 #include "process.h"
 #include "screen.h"
 
@@ -54,6 +55,94 @@ static void system_clean_up(void)
     clean_up();
 }
 
+static uint64_t system_mmap(uint64_t size, uint64_t flags)
+{
+    uint64_t va;
+
+    va = map_memory(current_address_space(), size, flags);
+    if (va == 0)
+        return SYS_ERROR;
+
+    return va;
+}
+
+static int system_madvise(uint64_t va, uint64_t size, uint64_t advice)
+{
+    switch (advice) {
+    case MADV_DONTNEED:
+        return discard_memory(current_address_space(), va, size);
+    }
+    return SYS_ERROR;
+}
+
+static uint64_t system_working_set(uint64_t pid, uint64_t kind)
+{
+    struct address_space *as;
+
+    if ((as = find_address_space(pid)) == 0)
+        return SYS_ERROR;
+
+    switch (kind) {
+    case WS_HOT:
+        return as->ws.hot;
+    case WS_COLD:
+        return as->ws.cold;
+    case WS_DIRTY:
+        return as->ws.dirty;
+    case WS_TICK:
+        return as->ws.tick;
+    }
+    return SYS_ERROR;
+}
+
+static uint64_t system_memory_stat(uint64_t pid, uint64_t figure)
+{
+    struct memory_account *m;
+    uint64_t kind = figure & ~(uint64_t) (MEM_PEAK | MEM_GROUP);
+
+    if ((m = find_memory_account(pid, (figure & MEM_GROUP) != 0)) == 0)
+        return SYS_ERROR;
+
+    if (kind < NUM_MEMORY_KINDS)
+        return figure & MEM_PEAK ? m->peak[kind] : m->used[kind];
+
+    switch (kind) {
+    case MEM_TOTAL:
+        return figure & MEM_PEAK ? m->total_peak : m->total;
+    case MEM_LIMIT:
+        return m->limit;
+    }
+    return SYS_ERROR;
+}
+
+static int system_memory_limit(uint64_t pid, uint64_t scope, uint64_t frames)
+{
+    /*
+     * Sets the memory limit of a process, or of its group, in frames. It
+     * may be set below what is already in use, which stops further growth,
+     * but not above the default. Only the caller and its descendants can
+     * be limited.
+     */
+    struct memory_account *m;
+    uint64_t max;
+
+    if (scope != 0 && scope != MEM_GROUP)
+        return SYS_ERROR;
+
+    max = (uint64_t) (scope ? GROUP_MEMORY_LIMIT : PROCESS_MEMORY_LIMIT)
+        >> EXP_4_KIB;
+    if (frames > max)
+        return SYS_ERROR;
+
+    if (!may_limit_memory(pid, scope == MEM_GROUP)
+        || (m = find_memory_account(pid, scope == MEM_GROUP)) == 0)
+        return SYS_ERROR;
+
+    m->limit = frames;
+
+    return 0;
+}
+
 void system_call(struct interrupt_stack_frame *isf_va)
 {
     /*
@@ -108,6 +197,79 @@ void system_call(struct interrupt_stack_frame *isf_va)
         isf_va->rax = 0;
         break;
 
+    case SYS_CALL_FORK:
+        /* Check number of args. */
+        if (isf_va->rdi != 0) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = (uint64_t) fork(isf_va);
+        break;
+
+    case SYS_CALL_MMAP:
+        /* Check number of args. */
+        if (isf_va->rdi != 2) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = system_mmap(arg_array[0], arg_array[1]);
+        break;
+
+    case SYS_CALL_MUNMAP:
+        /* Check number of args. */
+        if (isf_va->rdi != 2) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = (uint64_t) unmap_memory(
+            current_address_space(), arg_array[0], arg_array[1]);
+        break;
+
+    case SYS_CALL_MADVISE:
+        /* Check number of args. */
+        if (isf_va->rdi != 3) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = (uint64_t) system_madvise(
+            arg_array[0], arg_array[1], arg_array[2]);
+        break;
+
+    case SYS_CALL_WORKING_SET:
+        /* Check number of args. */
+        if (isf_va->rdi != 2) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = system_working_set(arg_array[0], arg_array[1]);
+        break;
+
+    case SYS_CALL_MEMORY_STAT:
+        /* Check number of args. */
+        if (isf_va->rdi != 2) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = system_memory_stat(arg_array[0], arg_array[1]);
+        break;
+
+    case SYS_CALL_MEMORY_LIMIT:
+        /* Check number of args. */
+        if (isf_va->rdi != 3) {
+            isf_va->rax = SYS_ERROR;
+            return;
+        }
+
+        isf_va->rax = (uint64_t) system_memory_limit(
+            arg_array[0], arg_array[1], arg_array[2]);
+        break;
+
     default:
         isf_va->rax = SYS_ERROR;
         return;
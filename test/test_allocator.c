@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test physical memory allocator, and benchmark it under threads. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "../address.h"
+#include "../allocator.h"
+#include "test_defs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS 8
+#define BATCH       8
+#define ROUNDS      200000
+
+/* The test memory is split into two NUMA nodes, with CPUs alternating. */
+#define NODE_1_PA (TEST_MEMORY_SIZE / 2)
+
+uint64_t test_memory_va;
+
+static pthread_key_t cpu_key;
+static int errors = 0;
+
+/*
+ * Single pages go through the magazines. Larger blocks go straight to the
+ * buddy allocator, under its lock, for comparison.
+ */
+static uint32_t order;
+
+unsigned int test_current_cpu(void)
+{
+    return (unsigned int) (size_t) pthread_getspecific(cpu_key);
+}
+
+uint32_t count_numa_nodes(void)
+{
+    return 2;
+}
+
+uint32_t current_node(void)
+{
+    return test_current_cpu() % 2;
+}
+
+uint32_t find_numa_node(uint64_t pa, uint64_t *end_pa_excl)
+{
+    if (pa < NODE_1_PA) {
+        *end_pa_excl = NODE_1_PA;
+        return 0;
+    }
+
+    *end_pa_excl = U64_MAX;
+    return 1;
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to)
+{
+    return from == to ? 10 : 20;
+}
+
+static void *worker(void *arg)
+{
+    size_t id = (size_t) arg;
+    uint64_t p[BATCH];
+    int i, j;
+
+    pthread_setspecific(cpu_key, arg);
+
+    for (i = 0; i < ROUNDS; ++i) {
+        for (j = 0; j < BATCH; ++j) {
+            if (!(p[j] = allocate_pages_pa(order, ALLOC_NO_ZERO))) {
+                printf("Out of memory\n");
+                ++errors;
+                return NULL;
+            }
+            /* Each page should only be handed to one thread at a time. */
+            *(uint64_t *) pa_to_va(p[j]) = id;
+
+            if ((p[j] >= NODE_1_PA) != (int) current_node()) {
+                printf("Page from remote node: %lx\n", (unsigned long) p[j]);
+                ++errors;
+            }
+        }
+
+        for (j = 0; j < BATCH; ++j) {
+            if (*(uint64_t *) pa_to_va(p[j]) != id) {
+                printf("Page shared between threads: %lx\n",
+                    (unsigned long) p[j]);
+                ++errors;
+            }
+            free_pages_pa(p[j], order);
+        }
+    }
+
+    return NULL;
+}
+
+static int check_sharing(void)
+{
+    /* A shared page or frame is only freed by its last holder. */
+    uint64_t free_bytes, p, f;
+
+    free_bytes = count_free_physical_memory();
+
+    p = allocate_pages_pa(0, ALLOC_NO_ZERO);
+    f = allocate_frame_pa(ALLOC_NO_ZERO);
+    if (!p || !f || share_pa(p) || share_pa(f) || count_references_pa(p) != 2
+        || count_references_pa(f) != 2) {
+        printf("Sharing failed\n");
+        return -1;
+    }
+
+    free_pages_pa(p, 0);
+    free_frame_pa(f);
+
+    if (count_references_pa(p) != 1 || count_references_pa(f) != 1) {
+        printf("Shared memory freed early\n");
+        return -1;
+    }
+
+    free_pages_pa(p, 0);
+    free_frame_pa(f);
+
+    if (count_references_pa(p) || count_references_pa(f)
+        || count_free_physical_memory() != free_bytes) {
+        printf("Shared memory not freed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    struct pa_range_descriptor *d;
+    pthread_t thread[MAX_THREADS];
+    struct timespec start, stop;
+    uint64_t free_bytes, ns, p;
+    size_t n, i;
+
+    if (!(test_memory_va = (uint64_t) malloc(TEST_MEMORY_SIZE)))
+        return 1;
+
+    if (pthread_key_create(&cpu_key, NULL))
+        return 1;
+
+    /* Memory map. */
+    *(uint32_t *) MEMORY_MAP_ENTRY_COUNT_VA = 2;
+    d = (struct pa_range_descriptor *) MEMORY_MAP_VA;
+    d[0].pa = 0;
+    d[0].size = 0x9fc00;
+    d[0].type = MEMORY_TYPE_USABLE;
+    d[1].pa = 0x100000;
+    d[1].size = TEST_MEMORY_SIZE - 0x100000;
+    d[1].type = MEMORY_TYPE_USABLE;
+
+    if (init_free_physical_memory() || check_physical_memory())
+        return 1;
+
+    free_bytes = count_free_physical_memory();
+
+    /* Allocations can name a node other than that of the CPU. */
+    p = allocate_pages_pa(0, ALLOC_NODE(1));
+    if (p < NODE_1_PA) {
+        printf("Node 1 allocation from node 0: %lx\n", (unsigned long) p);
+        return 1;
+    }
+    free_pages_pa(p, 0);
+
+    p = allocate_frame_pa(ALLOC_NODE(1));
+    if (p < NODE_1_PA) {
+        printf("Node 1 frame from node 0: %lx\n", (unsigned long) p);
+        return 1;
+    }
+    free_frame_pa(p);
+
+    if (check_sharing())
+        return 1;
+
+    for (order = 0; order < 2; ++order) {
+        for (n = 1; n <= MAX_THREADS; n *= 2) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (i = 0; i < n; ++i)
+                if (pthread_create(thread + i, NULL, worker, (void *) i))
+                    return 1;
+
+            for (i = 0; i < n; ++i)
+                pthread_join(thread[i], NULL);
+
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            ns = (uint64_t) (stop.tv_sec - start.tv_sec) * 1000000000
+                + (uint64_t) stop.tv_nsec - (uint64_t) start.tv_nsec;
+
+            printf("Order: %lu, threads: %lu, allocations and frees per "
+                   "second: %lu\n",
+                (unsigned long) order, (unsigned long) n,
+                (unsigned long) ((uint64_t) n * ROUNDS * BATCH * 2
+                    * 1000000000 / ns));
+
+            if (check_physical_memory())
+                return 1;
+
+            if (count_free_physical_memory() != free_bytes) {
+                printf("Free memory drifted\n");
+                return 1;
+            }
+        }
+    }
+
+    report_physical_memory();
+
+    free((void *) test_memory_va);
+
+    return errors != 0;
+}
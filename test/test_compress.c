@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test LZ compression. */
+
+#include "../compress.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BUF_BYTES 4096
+
+/* Bytes past the capacity that must not be written. */
+#define GUARD_BYTES 64
+#define GUARD       0xA5
+
+static unsigned char in[BUF_BYTES];
+static unsigned char packed[2 * BUF_BYTES + GUARD_BYTES];
+static unsigned char out[BUF_BYTES + GUARD_BYTES];
+
+static int guard_intact(const unsigned char *p)
+{
+    int k;
+
+    for (k = 0; k < GUARD_BYTES; ++k)
+        if (p[k] != GUARD)
+            return 0;
+
+    return 1;
+}
+
+static int round_trip(const char *name, uint32_t size, int compressible)
+{
+    uint32_t c;
+    int64_t d;
+
+    memset(packed, GUARD, sizeof(packed));
+    memset(out, GUARD, sizeof(out));
+
+    c = compress_lz(in, size, packed, 2 * BUF_BYTES);
+    if (c == 0 || !guard_intact(packed + 2 * BUF_BYTES)) {
+        printf("%s: Compression failed\n", name);
+        return 1;
+    }
+
+    if (compressible && c >= size / 2) {
+        printf("%s: Poor compression: %lu -> %lu\n", name,
+            (unsigned long) size, (unsigned long) c);
+        return 1;
+    }
+
+    d = decompress_lz(packed, c, out, BUF_BYTES);
+    if (d != (int64_t) size || memcmp(in, out, size)
+        || !guard_intact(out + BUF_BYTES)) {
+        printf("%s: Round trip failed\n", name);
+        return 1;
+    }
+
+    /* Too little room must be reported, and not overrun. */
+    if (size && compress_lz(in, size, packed, c - 1) != 0) {
+        printf("%s: Output overran its capacity\n", name);
+        return 1;
+    }
+
+    memset(out, GUARD, sizeof(out));
+    if (size
+        && (decompress_lz(packed, c, out, size - 1) != -1
+            || !guard_intact(out + size - 1))) {
+        printf("%s: Decompression overran its capacity\n", name);
+        return 1;
+    }
+
+    printf("%s: %lu -> %lu\n", name, (unsigned long) size, (unsigned long) c);
+
+    return 0;
+}
+
+int main(void)
+{
+    uint32_t k, x = 1;
+    uint32_t c;
+
+    memset(in, 0, BUF_BYTES);
+    if (round_trip("Zero", BUF_BYTES, 1))
+        return 1;
+
+    for (k = 0; k < BUF_BYTES; ++k) in[k] = (unsigned char) (k % 7 * 13);
+    if (round_trip("Pattern", BUF_BYTES, 1))
+        return 1;
+
+    for (k = 0; k < BUF_BYTES; ++k)
+        in[k] = (unsigned char) "the quick brown fox jumps "[k * k % 26];
+    if (round_trip("Text", BUF_BYTES, 0))
+        return 1;
+
+    for (k = 0; k < BUF_BYTES; ++k) {
+        x = x * 1103515245 + 12345;
+        in[k] = (unsigned char) (x >> 16);
+    }
+    if (round_trip("Random", BUF_BYTES, 0))
+        return 1;
+
+    if (round_trip("Short", 3, 0) || round_trip("Empty", 0, 0))
+        return 1;
+
+    /* Malformed input: an offset before the start of the output. */
+    memset(in, 'a', 64);
+    c = compress_lz(in, 64, packed, sizeof(packed));
+    packed[2] = 0xFF;
+    if (decompress_lz(packed, c, out, BUF_BYTES) != -1) {
+        printf("Malformed input accepted\n");
+        return 1;
+    }
+
+    /* Input that stops within an offset. */
+    if (decompress_lz(packed, 3, out, BUF_BYTES) != -1) {
+        printf("Truncated input accepted\n");
+        return 1;
+    }
+
+    return 0;
+}
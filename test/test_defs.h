@@ -37,6 +37,13 @@ extern int dummy;
 #define MAX_NODES 512
 #endif
 
+/* Virtual memory areas. */
+#ifdef DEBUG
+#define MAX_VMAS 8
+#else
+#define MAX_VMAS 16
+#endif
+
 /* Circular buffer. */
 #ifdef DEBUG
 #define CIRCULAR_BUFFER_SIZE 4
@@ -44,4 +51,38 @@ extern int dummy;
 #define CIRCULAR_BUFFER_SIZE 512
 #endif
 
+/* Physical memory allocator. */
+#include <stdint.h>
+
+/* The test memory stands in for physical memory from address zero. */
+extern uint64_t test_memory_va;
+#define KERNEL_SPACE_VA test_memory_va
+
+#define EXP_4_KIB       12
+#define EXP_2_MIB       21
+#define PAGE_SIZE       (1 << EXP_2_MIB)
+#define FRAME_SIZE      (1 << EXP_4_KIB)
+#define FRAMES_PER_PAGE (PAGE_SIZE / FRAME_SIZE)
+#define PAGE_ORDERS     11
+#define U64_MAX         0xFFFFFFFFFFFFFFFF
+#define U32_MAX         0xFFFFFFFF
+#define U16_MAX         0xFFFF
+
+#define TEST_MEMORY_SIZE          ((uint64_t) 512 << 20)
+#define MAX_MAPPED_VA_EXCL        (KERNEL_SPACE_VA + TEST_MEMORY_SIZE)
+#define MEMORY_MAP_ENTRY_COUNT_VA (KERNEL_SPACE_VA + 0x9000)
+#define MEMORY_MAP_VA             (MEMORY_MAP_ENTRY_COUNT_VA + 4)
+#define KERNEL_END_VA             (KERNEL_SPACE_VA + 0x400000)
+
+#define MAX_CPUS 8
+unsigned int test_current_cpu(void);
+#define current_cpu() test_current_cpu()
+
+/* NUMA topology, provided by the test. */
+#define MAX_NUMA_NODES 2
+uint32_t count_numa_nodes(void);
+uint32_t current_node(void);
+uint32_t find_numa_node(uint64_t pa, uint64_t *end_pa_excl);
+uint32_t numa_distance(uint32_t from, uint32_t to);
+
 #endif
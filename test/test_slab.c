@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the slab allocator. */
+
+#include "../address.h"
+#include "../allocator.h"
+#include "../slab.h"
+#include "test_defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Frames handed out by the stand-in for the frame allocator. */
+#define TEST_FRAMES 16
+
+#define OBJECT_SIZE 100
+
+/* Objects allocated from the test cache, more than fit in two slabs. */
+#define NUM_OBJECTS 100
+
+uint64_t test_memory_va;
+
+static int frame_used[TEST_FRAMES];
+static int frames_out = 0;
+static int fail_frames = 0;
+static int constructed = 0;
+
+uint64_t allocate_frame_pa(uint32_t flags)
+{
+    /* Frame zero is never handed out, as its address means failure. */
+    int i;
+
+    (void) flags;
+
+    if (fail_frames)
+        return 0;
+
+    for (i = 1; i < TEST_FRAMES; ++i)
+        if (!frame_used[i]) {
+            frame_used[i] = 1;
+            ++frames_out;
+            return (uint64_t) i * FRAME_SIZE;
+        }
+
+    return 0;
+}
+
+void free_frame_pa(uint64_t frame_pa)
+{
+    uint64_t i = frame_pa / FRAME_SIZE;
+
+    if (frame_pa % FRAME_SIZE || i == 0 || i >= TEST_FRAMES
+        || !frame_used[i]) {
+        printf("Invalid frame free: %lx\n", (unsigned long) frame_pa);
+        exit(1);
+    }
+
+    frame_used[i] = 0;
+    --frames_out;
+}
+
+static void construct(void *object)
+{
+    memset(object, 0xAB, OBJECT_SIZE);
+    ++constructed;
+}
+
+static int check_counters(const struct slab_cache *c, uint64_t num_slabs,
+    uint64_t used, uint64_t allocations, uint64_t frees, int frames)
+{
+    /* The frames held by the cache are counted from the given number. */
+    if (c->num_slabs != num_slabs || c->used_objects != used
+        || c->allocations != allocations || c->frees != frees
+        || frames_out != frames + (int) num_slabs) {
+        printf("Wrong counters: slabs: %lu, used: %lu, allocations: %lu, "
+               "frees: %lu, frames: %d\n",
+            (unsigned long) c->num_slabs, (unsigned long) c->used_objects,
+            (unsigned long) c->allocations, (unsigned long) c->frees,
+            frames_out);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int check_cache(void)
+{
+    /*
+     * Fills a cache across several slabs, checks that the objects are
+     * constructed and do not overlap, and then frees them out of order.
+     */
+    static struct slab_cache c;
+    unsigned char *p[NUM_OBJECTS];
+    uint64_t slabs;
+    int i, j, frames = frames_out;
+
+    if (init_slab_cache(&c, "test", OBJECT_SIZE, construct)) {
+        printf("Cache set up failed\n");
+        return 1;
+    }
+
+    if (c.object_size % 8 || c.slab_objects * 2 >= NUM_OBJECTS) {
+        printf("Wrong cache layout: size: %lu, objects: %lu\n",
+            (unsigned long) c.object_size, (unsigned long) c.slab_objects);
+        return 1;
+    }
+
+    for (i = 0; i < NUM_OBJECTS; ++i) {
+        if ((p[i] = allocate_object(&c)) == 0) {
+            printf("Allocation failed: %d\n", i);
+            return 1;
+        }
+
+        if ((uint64_t) p[i] % 8
+            || (uint64_t) p[i] / FRAME_SIZE
+                != ((uint64_t) p[i] + OBJECT_SIZE - 1) / FRAME_SIZE) {
+            printf("Object crosses a frame: %d\n", i);
+            return 1;
+        }
+
+        for (j = 0; j < OBJECT_SIZE; ++j)
+            if (p[i][j] != 0xAB) {
+                printf("Object not constructed: %d\n", i);
+                return 1;
+            }
+
+        memset(p[i], i, OBJECT_SIZE);
+    }
+
+    slabs = (NUM_OBJECTS + c.slab_objects - 1) / c.slab_objects;
+    if (constructed != (int) (slabs * c.slab_objects)
+        || check_counters(&c, slabs, NUM_OBJECTS, NUM_OBJECTS, 0, frames))
+        return 1;
+
+    for (i = 0; i < NUM_OBJECTS; ++i)
+        for (j = 0; j < OBJECT_SIZE; ++j)
+            if (p[i][j] != (unsigned char) i) {
+                printf("Objects overlap: %d\n", i);
+                return 1;
+            }
+
+    /* Free from both ends, so that full and partial slabs empty. */
+    for (i = 0; i < NUM_OBJECTS / 2; ++i) {
+        free_object(p[i]);
+        free_object(p[NUM_OBJECTS - 1 - i]);
+    }
+
+    /* One empty slab is kept. */
+    if (check_counters(&c, 1, 0, NUM_OBJECTS, NUM_OBJECTS, frames))
+        return 1;
+
+    /* The empty slab is used again, without constructing its objects. */
+    p[0] = allocate_object(&c);
+    if (p[0] == 0 || constructed != (int) (slabs * c.slab_objects)
+        || check_counters(&c, 1, 1, NUM_OBJECTS + 1, NUM_OBJECTS, frames))
+        return 1;
+
+    free_object(p[0]);
+
+    /* A failed slab allocation is counted. */
+    fail_frames = 1;
+    for (i = 0; i < (int) c.slab_objects; ++i)
+        if ((p[i] = allocate_object(&c)) == 0) {
+            printf("Empty slab not used: %d\n", i);
+            return 1;
+        }
+
+    if (allocate_object(&c) != 0 || c.failures != 1) {
+        printf("Failure not reported\n");
+        return 1;
+    }
+
+    fail_frames = 0;
+
+    for (i = 0; i < (int) c.slab_objects; ++i)
+        free_object(p[i]);
+
+    return check_counters(&c, 1, 0, NUM_OBJECTS + 1 + c.slab_objects,
+        NUM_OBJECTS + 1 + c.slab_objects, frames);
+}
+
+static int check_invalid_frees(void)
+{
+    /* Pointers that are not objects are rejected, and nothing changes. */
+    static struct slab_cache c;
+    unsigned char *p;
+    uint64_t foreign_pa;
+    int frames = frames_out;
+
+    if (init_slab_cache(&c, "invalid", OBJECT_SIZE, 0)
+        || (p = allocate_object(&c)) == 0
+        || !(foreign_pa = allocate_frame_pa(0)))
+        return 1;
+
+    memset((void *) pa_to_va(foreign_pa), 0, FRAME_SIZE);
+
+    kfree((void *) (pa_to_va(foreign_pa) + 64));
+    kfree(p + 1);
+    kfree(p - 8); /* In the slab header. */
+    kfree(0);
+
+    if (c.used_objects != 1 || c.frees != 0 || frames_out != frames + 2) {
+        printf("Invalid free accepted\n");
+        return 1;
+    }
+
+    kfree(p);
+    free_frame_pa(foreign_pa);
+
+    return check_counters(&c, 1, 0, 1, 1, frames);
+}
+
+static int check_kmalloc(void)
+{
+    /* Sizes go to the smallest class that fits, up to half a frame. */
+    static const uint32_t size[] = { 0, 1, 16, 17, 100, 1024, 2048 };
+    unsigned char *p[sizeof(size) / sizeof(size[0])];
+    size_t i;
+
+    if (init_kmalloc())
+        return 1;
+
+    for (i = 0; i < sizeof(size) / sizeof(size[0]); ++i) {
+        if ((p[i] = kmalloc(size[i])) == 0) {
+            printf("kmalloc failed: %lu\n", (unsigned long) size[i]);
+            return 1;
+        }
+
+        memset(p[i], 0xCD, size[i]);
+    }
+
+    if (kmalloc(FRAME_SIZE / 2 + 1) != 0) {
+        printf("kmalloc too large\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(size) / sizeof(size[0]); ++i) kfree(p[i]);
+
+    return report_slab_caches() != 0;
+}
+
+int main(void)
+{
+    unsigned char *memory;
+
+    if (!(memory = malloc((TEST_FRAMES + 1) * FRAME_SIZE)))
+        return 1;
+
+    /* Slabs are found by truncating addresses, so frames must be aligned. */
+    test_memory_va = ((uint64_t) memory + FRAME_SIZE - 1) / FRAME_SIZE
+        * FRAME_SIZE;
+
+    if (check_cache() || check_invalid_frees() || check_kmalloc())
+        return 1;
+
+    printf("Slab allocator: OK\n");
+
+    free(memory);
+
+    return 0;
+}
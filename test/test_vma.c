@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the virtual memory area tree. */
+
+#include "../vma.h"
+#include <stdio.h>
+#include <string.h>
+
+#define AREA_SIZE 0x1000
+
+static struct vma_tree t;
+
+static struct vma *add(uint64_t start_va, uint64_t end_va_excl)
+{
+    struct vma a;
+
+    memset(&a, 0, sizeof(struct vma));
+    a.start_va = start_va;
+    a.end_va_excl = end_va_excl;
+
+    return insert_vma(&t, &a);
+}
+
+static int check_lookups(void)
+{
+    /* Every area in the tree is at an even multiple of AREA_SIZE. */
+    struct vma *a;
+    uint64_t k, va;
+
+    for (k = 0; k < 4 * MAX_VMAS; ++k) {
+        va = k * AREA_SIZE + AREA_SIZE / 2;
+        a = find_vma(&t, va);
+
+        if (a != 0 && (va < a->start_va || va >= a->end_va_excl)) {
+            printf("Wrong area for: %lx\n", (unsigned long) va);
+            return 1;
+        }
+
+        a = find_next_vma(&t, va);
+        if (a != 0 && a->end_va_excl <= va) {
+            printf("Wrong next area for: %lx\n", (unsigned long) va);
+            return 1;
+        }
+    }
+
+    if (check_vma_tree(&t)) {
+        printf("Invalid tree\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int fill(const int *order)
+{
+    /* Inserts an area for every node, in the given order. */
+    uint64_t va;
+    int i;
+
+    init_vma_tree(&t);
+
+    for (i = 0; i < MAX_VMAS; ++i) {
+        va = (uint64_t) order[i] * 2 * AREA_SIZE;
+        if (add(va, va + AREA_SIZE) == 0) {
+            printf("Insert failed: %lx\n", (unsigned long) va);
+            return 1;
+        }
+
+        if (check_lookups())
+            return 1;
+    }
+
+    if (add(4 * MAX_VMAS * AREA_SIZE, 5 * MAX_VMAS * AREA_SIZE) != 0) {
+        printf("Insert into a full tree\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int empty(const int *order)
+{
+    /* Removes every area, in the given order. */
+    int i;
+
+    for (i = 0; i < MAX_VMAS; ++i) {
+        if (remove_vma(&t, (uint64_t) order[i] * 2 * AREA_SIZE)) {
+            printf("Remove failed: %d\n", order[i]);
+            return 1;
+        }
+
+        if (find_vma(&t, (uint64_t) order[i] * 2 * AREA_SIZE) != 0) {
+            printf("Area still found: %d\n", order[i]);
+            return 1;
+        }
+
+        if (check_lookups())
+            return 1;
+    }
+
+    if (t.count != 0 || t.root != -1) {
+        printf("Tree not empty\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    int up[MAX_VMAS], down[MAX_VMAS], mixed[MAX_VMAS];
+    int i;
+
+    for (i = 0; i < MAX_VMAS; ++i) {
+        up[i] = i;
+        down[i] = MAX_VMAS - 1 - i;
+        /* 5 and MAX_VMAS have no common factor, so all indices are used. */
+        mixed[i] = (i * 5 + 3) % MAX_VMAS;
+    }
+
+    if (fill(up) || empty(up) || fill(down) || empty(up) || fill(mixed)
+        || empty(down) || fill(up) || empty(mixed))
+        return 1;
+
+    /* Overlaps and empty areas are rejected. */
+    init_vma_tree(&t);
+    if (add(2 * AREA_SIZE, 4 * AREA_SIZE) == 0
+        || add(AREA_SIZE, 3 * AREA_SIZE) != 0
+        || add(3 * AREA_SIZE, 5 * AREA_SIZE) != 0
+        || add(2 * AREA_SIZE, 4 * AREA_SIZE) != 0
+        || add(5 * AREA_SIZE, 5 * AREA_SIZE) != 0
+        || add(AREA_SIZE, 2 * AREA_SIZE) == 0
+        || add(4 * AREA_SIZE, 5 * AREA_SIZE) == 0) {
+        printf("Overlap not detected\n");
+        return 1;
+    }
+
+    if (find_vma(&t, 0) != 0 || find_vma(&t, 5 * AREA_SIZE) != 0
+        || find_vma(&t, 3 * AREA_SIZE)->start_va != 2 * AREA_SIZE
+        || find_next_vma(&t, 0)->start_va != AREA_SIZE
+        || find_next_vma(&t, 5 * AREA_SIZE) != 0) {
+        printf("Lookup failed\n");
+        return 1;
+    }
+
+    if (remove_vma(&t, 3 * AREA_SIZE) != -1 || t.count != 3
+        || check_vma_tree(&t)) {
+        printf("Removed a missing area\n");
+        return 1;
+    }
+
+    printf("VMA tree: OK\n");
+
+    return 0;
+}
@@ -23,14 +23,61 @@
  * SUCH DAMAGE.
  */
 
+#include "../defs.h"
 #include "../user_lib/printf.h"
 #include "../user_lib/u_system_call.h"
 
+static uint64_t deep(uint64_t n)
+{
+    /* Uses about 1 KiB of stack per call, so that the stack grows. */
+    volatile char frame[1024];
+
+    frame[0] = (char) n;
+    return n ? deep(n - 1) + (uint64_t) frame[0] % 2 : 0;
+}
+
+static uint64_t use_heap(void)
+{
+    /*
+     * Writes to both pages of a huge mapping, gives the second one back, and
+     * reads it again, when it is zero. Returns the sum that is read.
+     */
+    volatile char *p;
+    uint64_t sum;
+
+    p = u_mmap(2 * PAGE_SIZE, MAP_HUGE);
+    if (p == (void *) SYS_ERROR)
+        return U64_MAX;
+
+    p[0] = 1;
+    p[PAGE_SIZE] = 2;
+    (void) u_madvise((void *) (p + PAGE_SIZE), PAGE_SIZE, MADV_DONTNEED);
+    sum = (uint64_t) (p[0] + p[PAGE_SIZE]);
+    (void) u_munmap((void *) p, 2 * PAGE_SIZE);
+
+    return sum;
+}
+
 int main(void)
 {
     char *p_in_kernel_space = (char *) 0xffff8000000b8000;
+    int pid;
     (void) printf("---------- User app B: Start ----------\n");
+
+    pid = u_fork();
+    if (pid == 0) {
+        (void) printf("User app B: Child: %lu\n", deep(256));
+        (void) printf("User app B: Child heap: %lu\n", use_heap());
+        return 0;
+    }
+    (void) printf("User app B: Forked pid: %ld\n", (int64_t) pid);
+
     (void) u_sleep(5);
+    (void) printf("User app B: Working set: hot: %ld, cold: %ld\n",
+        u_working_set(0, WS_HOT), u_working_set(0, WS_COLD));
+    (void) printf("User app B: Memory: %ld frames, peak: %ld, group: %ld\n",
+        u_memory_stat(0, MEM_TOTAL), u_memory_stat(0, MEM_TOTAL | MEM_PEAK),
+        u_memory_stat(0, MEM_TOTAL | MEM_GROUP));
     *p_in_kernel_space = 'x';
     (void) printf("---------- User app B: End ----------\n");
 
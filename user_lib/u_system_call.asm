@@ -39,6 +39,13 @@ global u_system_write
 global u_sleep
 global u_exit
 global u_clean_up
+global u_fork
+global u_mmap
+global u_munmap
+global u_madvise
+global u_working_set
+global u_memory_stat
+global u_memory_limit
 
 
 
@@ -127,3 +134,171 @@ int SOFTWARE_INT
 mov rsp, rbp
 pop rbp
 ret
+
+
+
+
+u_fork:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; No args to be pushed to the stack.
+; Send number of original args on the stack as the first new argument.
+mov rdi, 0
+
+mov rax, SYS_CALL_FORK
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+
+u_mmap:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rsi ; Arg 2: Flags.
+push rdi ; Arg 1: Size.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 2
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_MMAP
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+
+u_munmap:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rsi ; Arg 2: Size.
+push rdi ; Arg 1: Address.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 2
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_MUNMAP
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+
+u_madvise:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rdx ; Arg 3: Advice.
+push rsi ; Arg 2: Size.
+push rdi ; Arg 1: Address.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 3
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_MADVISE
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+u_working_set:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rsi ; Arg 2: Figure.
+push rdi ; Arg 1: Process Id.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 2
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_WORKING_SET
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+u_memory_stat:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rsi ; Arg 2: Figure.
+push rdi ; Arg 1: Process Id.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 2
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_MEMORY_STAT
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
+
+
+
+u_memory_limit:
+; Stack frame.
+push rbp
+mov rbp, rsp
+
+; Push original args to the stack, in reverse order.
+push rdx ; Arg 3: Frames.
+push rsi ; Arg 2: Scope.
+push rdi ; Arg 1: Process Id.
+
+; Send number of original args on the stack as the first new argument.
+mov rdi, 3
+
+; Send stack pointer as second new argument.
+mov rsi, rsp
+
+mov rax, SYS_CALL_MEMORY_LIMIT
+int SOFTWARE_INT
+
+mov rsp, rbp
+pop rbp
+ret
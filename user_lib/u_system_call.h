@@ -40,4 +40,45 @@ int u_sleep(uint64_t seconds);
 void u_exit(void);
 void u_clean_up(void);
 
+/* Returns the pid of the child to the parent, and zero to the child. */
+int u_fork(void);
+
+/*
+ * Maps anonymous memory, which reads as zero until it is written. With
+ * MAP_HUGE, the size is rounded up to 2 MiB pages. Returns the address, or
+ * (void *) SYS_ERROR on failure.
+ */
+void *u_mmap(uint64_t size, uint64_t flags);
+
+/* The range must lie within one mapping. */
+int u_munmap(void *p, uint64_t size);
+
+/* Only MADV_DONTNEED is supported. */
+int u_madvise(void *p, uint64_t size, uint64_t advice);
+
+/*
+ * Returns a working-set figure of a process, such as WS_HOT, in frames. The
+ * kernel samples each process about once a second, taking one process per
+ * timer tick. WS_TICK is the timer count of the sample, which shows how old
+ * the figures are. A pid of zero is the calling process. Returns SYS_ERROR
+ * if there is no such live process.
+ */
+int64_t u_working_set(uint64_t pid, uint64_t kind);
+
+/*
+ * Returns a memory figure of a process, such as MEM_TOTAL, in frames. Add
+ * MEM_PEAK for its high-water mark, or MEM_GROUP for the figure of the
+ * group that the process belongs to. A pid of zero is the calling process.
+ */
+int64_t u_memory_stat(uint64_t pid, uint64_t figure);
+
+/*
+ * Sets the memory limit of a process, or with a scope of MEM_GROUP, of its
+ * group, in frames. Limits cannot be raised above the defaults. The process
+ * must be the caller or a descendant. A group limit can only be set by a
+ * member that every other live member descends from. Returns SYS_ERROR
+ * otherwise.
+ */
+int u_memory_limit(uint64_t pid, uint64_t scope, uint64_t frames);
+
 #endif
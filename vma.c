@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtual memory areas of a user space, kept in an AVL tree that uses static
+ * memory, so that the area holding an address is found in O(log n).
+ */
+
+#include "vma.h"
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+static int height(const struct vma_tree *t, int i)
+{
+    return i == -1 ? 0 : t->node[i].height;
+}
+
+static void update_height(struct vma_tree *t, int i)
+{
+    t->node[i].height
+        = max(height(t, t->node[i].left), height(t, t->node[i].right)) + 1;
+}
+
+static int rotate_right(struct vma_tree *t, int i)
+{
+    int x = t->node[i].left;
+
+    t->node[i].left = t->node[x].right;
+    t->node[x].right = i;
+    update_height(t, i);
+    update_height(t, x);
+
+    return x;
+}
+
+static int rotate_left(struct vma_tree *t, int i)
+{
+    int x = t->node[i].right;
+
+    t->node[i].right = t->node[x].left;
+    t->node[x].left = i;
+    update_height(t, i);
+    update_height(t, x);
+
+    return x;
+}
+
+static int balance(struct vma_tree *t, int i)
+{
+    /*
+     * Restores the AVL property at a node whose subtrees differ in height by
+     * at most two. Returns the new root of the subtree.
+     */
+    struct vma *a = t->node + i;
+
+    update_height(t, i);
+
+    if (height(t, a->left) - height(t, a->right) > 1) {
+        if (height(t, t->node[a->left].left)
+            < height(t, t->node[a->left].right))
+            a->left = rotate_left(t, a->left);
+
+        return rotate_right(t, i);
+    }
+
+    if (height(t, a->right) - height(t, a->left) > 1) {
+        if (height(t, t->node[a->right].right)
+            < height(t, t->node[a->right].left))
+            a->right = rotate_right(t, a->right);
+
+        return rotate_left(t, i);
+    }
+
+    return i;
+}
+
+static int insert_node(struct vma_tree *t, int i, int n)
+{
+    if (i == -1)
+        return n;
+
+    if (t->node[n].start_va < t->node[i].start_va)
+        t->node[i].left = insert_node(t, t->node[i].left, n);
+    else
+        t->node[i].right = insert_node(t, t->node[i].right, n);
+
+    return balance(t, i);
+}
+
+static int remove_min(struct vma_tree *t, int i, int *min)
+{
+    if (t->node[i].left == -1) {
+        *min = i;
+        return t->node[i].right;
+    }
+
+    t->node[i].left = remove_min(t, t->node[i].left, min);
+
+    return balance(t, i);
+}
+
+static int remove_node(struct vma_tree *t, int i, uint64_t start_va, int *n)
+{
+    int m;
+
+    if (i == -1)
+        return -1;
+
+    if (start_va < t->node[i].start_va) {
+        t->node[i].left = remove_node(t, t->node[i].left, start_va, n);
+    } else if (start_va > t->node[i].start_va) {
+        t->node[i].right = remove_node(t, t->node[i].right, start_va, n);
+    } else {
+        *n = i;
+        if (t->node[i].right == -1)
+            return t->node[i].left;
+
+        /* Replace it with the lowest area above it. */
+        t->node[i].right = remove_min(t, t->node[i].right, &m);
+        t->node[m].left = t->node[i].left;
+        t->node[m].right = t->node[i].right;
+
+        return balance(t, m);
+    }
+
+    return balance(t, i);
+}
+
+void init_vma_tree(struct vma_tree *t)
+{
+    int i;
+
+    t->root = -1;
+    t->count = 0;
+    t->free = 0;
+
+    for (i = 0; i < MAX_VMAS; ++i) t->node[i].left = i + 1;
+
+    t->node[MAX_VMAS - 1].left = -1;
+}
+
+struct vma *insert_vma(struct vma_tree *t, const struct vma *a)
+{
+    /*
+     * Adds a copy of an area, and returns it. Returns 0 if the area is
+     * empty, overlaps another area, or if the tree is full. The stored area
+     * stays in place until it is removed.
+     */
+    struct vma *next;
+    int i;
+
+    if (a->start_va >= a->end_va_excl || t->free == -1)
+        return 0;
+
+    next = find_next_vma(t, a->start_va);
+    if (next != 0 && next->start_va < a->end_va_excl)
+        return 0;
+
+    i = t->free;
+    t->free = t->node[i].left;
+
+    t->node[i] = *a;
+    t->node[i].left = -1;
+    t->node[i].right = -1;
+    t->node[i].height = 1;
+
+    t->root = insert_node(t, t->root, i);
+    ++t->count;
+
+    return t->node + i;
+}
+
+int remove_vma(struct vma_tree *t, uint64_t start_va)
+{
+    /* Removes the area that starts at an address. */
+    int n = -1;
+
+    t->root = remove_node(t, t->root, start_va, &n);
+    if (n == -1)
+        return -1;
+
+    t->node[n].left = t->free;
+    t->free = n;
+    --t->count;
+
+    return 0;
+}
+
+struct vma *find_next_vma(struct vma_tree *t, uint64_t va)
+{
+    /*
+     * Returns the lowest area that ends above an address, which is the area
+     * holding it if there is one. Returns 0 if there is none. As the areas
+     * do not overlap, their ends are in the same order as their starts.
+     */
+    int i, best = -1;
+
+    i = t->root;
+    while (i != -1) {
+        if (t->node[i].end_va_excl > va) {
+            best = i;
+            i = t->node[i].left;
+        } else {
+            i = t->node[i].right;
+        }
+    }
+
+    return best == -1 ? 0 : t->node + best;
+}
+
+struct vma *find_vma(struct vma_tree *t, uint64_t va)
+{
+    /* Returns the area that holds an address, or 0 if there is none. */
+    struct vma *a;
+
+    a = find_next_vma(t, va);
+    if (a == 0 || a->start_va > va)
+        return 0;
+
+    return a;
+}
+
+static int check_node(const struct vma_tree *t, int i, uint64_t *low_va,
+    int *count)
+{
+    /*
+     * Returns the height of a subtree, or -1 if it is unbalanced, or if its
+     * areas are out of order or overlap.
+     */
+    const struct vma *a;
+    int hl, hr;
+
+    if (i == -1)
+        return 0;
+
+    a = t->node + i;
+
+    if ((hl = check_node(t, a->left, low_va, count)) == -1)
+        return -1;
+
+    if (a->start_va < *low_va || a->start_va >= a->end_va_excl)
+        return -1;
+
+    *low_va = a->end_va_excl;
+    ++*count;
+
+    if ((hr = check_node(t, a->right, low_va, count)) == -1)
+        return -1;
+
+    if (hl - hr > 1 || hr - hl > 1 || a->height != max(hl, hr) + 1)
+        return -1;
+
+    return a->height;
+}
+
+int check_vma_tree(const struct vma_tree *t)
+{
+    /* Checks the order, balance and count of the areas in a tree. */
+    uint64_t low_va = 0;
+    int count = 0;
+
+    if (check_node(t, t->root, &low_va, &count) == -1 || count != t->count)
+        return -1;
+
+    return 0;
+}
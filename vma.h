@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtual memory areas of a user space, kept in an AVL tree that uses static
+ * memory.
+ */
+
+#ifndef VMA_H
+#define VMA_H
+
+#ifdef TOUCANIX
+#include "defs.h"
+#include "stdint.h"
+#else
+#include "test/test_defs.h"
+#include <stdint.h>
+#endif
+
+/* Kinds of backing. */
+#define VMA_RESIDENT  0 /* Read-only part of an image, shared. */
+#define VMA_DATA      1 /* Writable data, copied in from an image. */
+#define VMA_ANONYMOUS 2 /* Cleared memory, mapped at run time. */
+#define VMA_STACK     3 /* Cleared memory, backed a frame at a time. */
+#define VMA_GUARD     4 /* Never backed. */
+
+/* Permissions and options. */
+#define VMA_READ  1
+#define VMA_WRITE (1 << 1)
+#define VMA_HUGE  (1 << 2) /* 2 MiB pages where the area covers them. */
+
+struct vma {
+    uint64_t start_va;
+    uint64_t end_va_excl;
+    uint64_t source_va;   /* Data that is copied in on first touch. */
+    uint64_t source_size; /* The rest is cleared. */
+    uint32_t type;
+    uint32_t flags;
+    uint32_t resident; /* Index of the resident copy, for VMA_RESIDENT. */
+    /* Tree links, which are node indices, where -1 indicates none. */
+    int left;
+    int right;
+    int height;
+};
+
+/*
+ * The areas never overlap, so ordering them by start address is enough to
+ * find the area that holds an address. The nodes are referred to by index,
+ * so the tree can be copied as a whole. The free list is linked through the
+ * left index.
+ */
+struct vma_tree {
+    int root;
+    int free;
+    int count;
+    struct vma node[MAX_VMAS];
+};
+
+void init_vma_tree(struct vma_tree *t);
+struct vma *insert_vma(struct vma_tree *t, const struct vma *a);
+int remove_vma(struct vma_tree *t, uint64_t start_va);
+struct vma *find_next_vma(struct vma_tree *t, uint64_t va);
+struct vma *find_vma(struct vma_tree *t, uint64_t va);
+int check_vma_tree(const struct vma_tree *t);
+
+#endif
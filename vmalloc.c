@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel virtual allocator.
+ *
+ * Hands out regions of kernel virtual memory that are backed by pages
+ * which need not be physically contiguous, so that large buffers can be
+ * had when physical memory is fragmented. The pages are mapped in the
+ * kernel virtual allocation area, which is shared by every address space.
+ *
+ * The area is managed in 2 MiB slots, with a bitmap of the slots in use.
+ * Each region is followed by an unmapped guard slot, so that running off
+ * the end of it faults rather than corrupting the next region.
+ */
+
+#include "vmalloc.h"
+#include "address.h"
+#include "allocator.h"
+#include "defs.h"
+#include "k_printf.h"
+#include "paging.h"
+#include "slab.h"
+
+#define SLOT_BITMAP_BITS 64
+
+#define slot_va(i) (VMALLOC_START_VA + ((uint64_t) (i) << EXP_2_MIB))
+#define va_slot(v) ((uint32_t) (((v) - VMALLOC_START_VA) >> EXP_2_MIB))
+
+#define slot_used(i)                                                          \
+    (slot_bitmap[(i) / SLOT_BITMAP_BITS] >> (i) % SLOT_BITMAP_BITS & 1)
+
+struct vmalloc_region {
+    uint64_t va;
+    uint32_t num_pages; /* Excluding the guard slot. */
+    struct vmalloc_region *next;
+};
+
+/* Set bits mark slots in use, including guard slots. */
+static uint64_t slot_bitmap[VMALLOC_PAGES / SLOT_BITMAP_BITS];
+
+static struct vmalloc_region *region_list = 0;
+static uint64_t num_regions = 0;
+static uint64_t num_mapped_pages = 0;
+static uint64_t num_failures = 0;
+
+static void mark_slots(uint32_t start, uint32_t n, int used)
+{
+    uint32_t i;
+
+    for (i = start; i < start + n; ++i)
+        if (used)
+            slot_bitmap[i / SLOT_BITMAP_BITS]
+                |= (uint64_t) 1 << i % SLOT_BITMAP_BITS;
+        else
+            slot_bitmap[i / SLOT_BITMAP_BITS]
+                &= ~((uint64_t) 1 << i % SLOT_BITMAP_BITS);
+}
+
+static int find_slots(uint32_t n, uint32_t *start)
+{
+    /* Finds the first run of n free slots. */
+    uint32_t i, run = 0;
+
+    for (i = 0; i < VMALLOC_PAGES; ++i) {
+        /* Skip whole words that are in use. */
+        if (!(i % SLOT_BITMAP_BITS)
+            && slot_bitmap[i / SLOT_BITMAP_BITS] == U64_MAX) {
+            i += SLOT_BITMAP_BITS - 1;
+            run = 0;
+            continue;
+        }
+
+        if (slot_used(i)) {
+            run = 0;
+        } else if (++run == n) {
+            *start = i + 1 - n;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void unmap_region(uint64_t va, uint32_t num_pages)
+{
+    uint32_t i;
+    uint64_t p;
+
+    for (i = 0; i < num_pages; ++i)
+        if ((p = unmap_kernel_page(va + ((uint64_t) i << EXP_2_MIB)))) {
+            free_page_pa(p);
+            --num_mapped_pages;
+        }
+}
+
+void *vmalloc(uint64_t size)
+{
+    /*
+     * Returns a cleared region of at least size bytes, rounded up to whole
+     * pages, or 0 on failure.
+     */
+    struct vmalloc_region *r;
+    uint32_t start, n, i;
+    uint64_t p;
+
+    if (size == 0 || size > (uint64_t) (VMALLOC_PAGES - 1) << EXP_2_MIB)
+        goto fail;
+
+    n = (uint32_t) (align_to_page(size) >> EXP_2_MIB);
+
+    if (find_slots(n + 1, &start))
+        goto fail;
+
+    if ((r = kmalloc(sizeof(struct vmalloc_region))) == 0)
+        goto fail;
+
+    r->va = slot_va(start);
+    r->num_pages = n;
+
+    for (i = 0; i < n; ++i) {
+        if (!(p = allocate_page_pa())) {
+            unmap_region(r->va, i);
+            kfree(r);
+            goto fail;
+        }
+
+        if (map_kernel_page(r->va + ((uint64_t) i << EXP_2_MIB), p)) {
+            free_page_pa(p);
+            unmap_region(r->va, i);
+            kfree(r);
+            goto fail;
+        }
+
+        ++num_mapped_pages;
+    }
+
+    mark_slots(start, n + 1, 1);
+
+    r->next = region_list;
+    region_list = r;
+    ++num_regions;
+
+    return (void *) r->va;
+
+fail:
+    ++num_failures;
+    return 0;
+}
+
+void vfree(void *p)
+{
+    struct vmalloc_region *r, *prev = 0;
+
+    if (p == 0)
+        return;
+
+    for (r = region_list; r != 0; prev = r, r = r->next)
+        if (r->va == (uint64_t) p)
+            break;
+
+    if (r == 0) {
+        (void) k_printf("ERROR: vmalloc: Invalid free: %lx\n",
+            (unsigned long) p);
+        return;
+    }
+
+    if (prev)
+        prev->next = r->next;
+    else
+        region_list = r->next;
+
+    --num_regions;
+
+    unmap_region(r->va, r->num_pages);
+    mark_slots(va_slot(r->va), r->num_pages + 1, 0);
+    kfree(r);
+}
+
+int report_vmalloc(void)
+{
+    if (k_printf("vmalloc: regions: %lu, pages: %lu/%lu, failures: %lu\n",
+            (unsigned long) num_regions, (unsigned long) num_mapped_pages,
+            (unsigned long) VMALLOC_PAGES, (unsigned long) num_failures)
+        == -1)
+        return -1;
+
+    return 0;
+}
+
+#if BOOT_CHECKS
+int check_vmalloc(uint32_t num_pages)
+{
+    /*
+     * Allocates a region, writes to every page of it, then frees it, and
+     * checks that all of the memory comes back.
+     */
+    uint64_t before, *q;
+    uint32_t i;
+
+    /* The first region may create a slab for its record, which is kept. */
+    vfree(vmalloc(PAGE_SIZE));
+
+    before = count_free_physical_memory();
+
+    if ((q = vmalloc((uint64_t) num_pages << EXP_2_MIB)) == 0) {
+        (void) k_printf("ERROR: vmalloc: Check allocation failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < num_pages; ++i)
+        q[((uint64_t) i << EXP_2_MIB) / sizeof(uint64_t)] = i;
+
+    for (i = 0; i < num_pages; ++i)
+        if (q[((uint64_t) i << EXP_2_MIB) / sizeof(uint64_t)] != i) {
+            (void) k_printf("ERROR: vmalloc: Check read back failed\n");
+            vfree(q);
+            return -1;
+        }
+
+    if (report_vmalloc()) {
+        vfree(q);
+        return -1;
+    }
+
+    vfree(q);
+
+    if (count_free_physical_memory() != before) {
+        (void) k_printf("ERROR: vmalloc: Drift: %lu -> %lu\n",
+            (unsigned long) before,
+            (unsigned long) count_free_physical_memory());
+        return -1;
+    }
+
+    return 0;
+}
+#endif